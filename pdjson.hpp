@@ -8,17 +8,121 @@
 #define NAMESPACE_END(name) }
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <initializer_list>
 #include <iostream>
+#include <list>
+#include <locale>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+#endif
+
+#if defined(PDJSON_HAS_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(PDJSON_HAS_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#include <cerrno>
+#include <unistd.h>
+#define PDJSON_HAS_FD 1
+#endif
+
 NAMESPACE_BEGIN(pd)
 
+NAMESPACE_BEGIN(detail)
+
+// Appends the quoted and escaped form of `origin` to `out`.
+// Shared by JsonNode::write and JsonWriter so both emit identical strings.
+inline void append_escaped(std::string &out, const char *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (size_t k = 0; k < size; ++k) {
+        char i = data[k];
+        switch (i) {
+        case '"':
+            out.append("\\\"", 2);
+            break;
+        case '\\':
+            out.append("\\\\", 2);
+            break;
+        case '\n':
+            out.append("\\n", 2);
+            break;
+        case '\b':
+            out.append("\\b", 2);
+            break;
+        case '\f':
+            out.append("\\f", 2);
+            break;
+        case '\r':
+            out.append("\\r", 2);
+            break;
+        case '\t':
+            out.append("\\t", 2);
+            break;
+        default:
+            if (static_cast<unsigned char>(i) < 0x20) {
+                out.append("\\u00", 4);
+                out.push_back(hex[(i >> 4) & 0xf]);
+                out.push_back(hex[i & 0xf]);
+            } else {
+                out.push_back(i);
+            }
+            break;
+        }
+    }
+    out.push_back('"');
+}
+
+inline void append_escaped(std::string &out, const std::string &origin)
+{
+    append_escaped(out, origin.data(), origin.size());
+}
+
+inline void write_indent(std::ostream &out, int depth)
+{
+    for (int i = 0; i < depth; i++)
+        out << '\t';
+}
+
+inline void write_key(std::ostream &out, const std::string &key)
+{
+    std::string escaped;
+    escaped.reserve(key.size() + 5);
+    append_escaped(escaped, key);
+    escaped.append(" : ", 3);
+    out.write(escaped.data(), static_cast<std::streamsize>(escaped.size()));
+}
+
+NAMESPACE_END(detail)
+
 enum class JsonType : uint8_t {
     kNull = 0,
     kBool = 1,
@@ -29,13 +133,33 @@ enum class JsonType : uint8_t {
 
 };
 
+struct JsonNode;
+
+NAMESPACE_BEGIN(detail)
+
+template<typename WriteChild>
+void write_container(const JsonNode &node, std::ostream &out, int idt, WriteChild child);
+
+NAMESPACE_END(detail)
+
 struct JsonNode
 {
     JsonNode() { this->type_ = JsonType::kNull; }
-    virtual JsonType get_type() /*final*/ { return type_; }
+    JsonNode(const JsonNode &other)
+        : type_(other.type_)
+    {}
+    JsonNode &operator=(const JsonNode &other)
+    {
+        type_ = other.type_;
+        mark_dirty();
+        return *this;
+    }
+    virtual JsonType get_type() const /*final*/ { return type_; }
 
     virtual void write(std::ostream &out, int indent = 0) { out << "null"; }
 
+    // Non-const accessors hand out mutable references and therefore invalidate
+    // the write cache (see set_write_cache); read through a const node to avoid that.
     virtual std::string &get_string() { throw std::runtime_error("It's not a string"); }
     virtual double &get_double() { throw std::runtime_error("It's not a number"); }
     virtual bool &get_bool() { throw std::runtime_error("It's not a bool"); }
@@ -47,6 +171,48 @@ struct JsonNode
     {
         throw std::runtime_error("It's not an array");
     }
+    virtual std::vector<double> &get_numbers()
+    {
+        throw std::runtime_error("It's not a numeric array");
+    }
+
+    virtual const std::string &get_string() const { throw std::runtime_error("It's not a string"); }
+    virtual const double &get_double() const { throw std::runtime_error("It's not a number"); }
+    virtual const bool &get_bool() const { throw std::runtime_error("It's not a bool"); }
+    virtual const std::unordered_map<std::string, std::shared_ptr<JsonNode>> &get_object() const
+    {
+        throw std::runtime_error("It's not an object");
+    }
+    virtual const std::vector<std::shared_ptr<JsonNode>> &get_array() const
+    {
+        throw std::runtime_error("It's not an array");
+    }
+    virtual const std::vector<double> &get_numbers() const
+    {
+        throw std::runtime_error("It's not a numeric array");
+    }
+
+    // Opt-in write cache for documents that are written again and again. An
+    // array/object with the cache enabled keeps its serialized bytes and only
+    // re-renders when something below it was changed through a non-const
+    // accessor, so a write after a small change re-renders just the path to it
+    // and copies the rest. Enabling it on the root is enough, children pick it
+    // up as they are written. Costs one copy of the output per nesting level.
+    // Changes made through references kept across a write are not seen; call
+    // mark_dirty() on the changed node after such a change.
+    virtual void set_write_cache(bool enabled) { (void) enabled; }
+
+    // Invalidates the cached output of this node and of its ancestors. A clean
+    // node only has clean children, so the walk stops at dirty nodes.
+    void mark_dirty()
+    {
+        if (dirty_)
+            return;
+        dirty_ = true;
+        for (auto &link : parents_)
+            if (link->node)
+                link->node->mark_dirty();
+    }
 
     inline void write_to_file(const std::string &filename)
     {
@@ -70,39 +236,106 @@ struct JsonNode
     //    };
 
 protected:
-    JsonType type_;
+    // Shared between a caching container and its children so the children can
+    // reach it; reset when the container goes away.
+    struct ParentLink
+    {
+        JsonNode *node;
+    };
 
-    static void process_string(std::ostream &out, const std::string &origin)
+    // Cached output of an array/object. Copies of a node start without cache.
+    struct WriteCache
     {
-        std::stringstream oss;
-        oss << '"';
-        for (auto i : origin) {
-            switch (i) {
-            case '"': {
-                oss << '\\' << '"';
-                break;
-            }
-            case '\n': {
-                oss << '\\' << 'n';
-                break;
-            }
-            case '\\': {
-                oss << '\\' << '\\';
-                break;
+        std::shared_ptr<ParentLink> self; // non-null while enabled
+        int indent = -1;
+        std::ios::fmtflags flags = std::ios::fmtflags();
+        std::streamsize precision = 0;
+        std::string text;
+
+        WriteCache() = default;
+        WriteCache(const WriteCache &) {}
+        WriteCache &operator=(const WriteCache &) { return *this; }
+        ~WriteCache() { enable(nullptr); }
+
+        void enable(JsonNode *owner)
+        {
+            if (self && !owner) {
+                self->node = nullptr;
+                self.reset();
+                std::string().swap(text);
+            } else if (!self && owner) {
+                self = std::make_shared<ParentLink>();
+                self->node = owner;
+                indent = -1;
             }
-            default:
-                oss << i;
-                break;
+        }
+    };
+
+    JsonType type_;
+    // Caching containers this node was written by; a subtree shared between
+    // several of them invalidates all. Only maintained while caching.
+    std::vector<std::shared_ptr<ParentLink>> parents_;
+    bool dirty_ = true;
+
+    // Writes through `cache` if it is enabled: `render` only runs when the node
+    // changed since the last write or the layout differs.
+    template<typename Render>
+    void write_cached(WriteCache &cache, std::ostream &out, int idt, Render render)
+    {
+        if (!cache.self) {
+            render(out);
+            return;
+        }
+        if (dirty_ || cache.indent != idt || cache.flags != out.flags()
+            || cache.precision != out.precision()) {
+            std::ostringstream oss;
+            oss.flags(out.flags());
+            oss.precision(out.precision());
+            oss.imbue(out.getloc());
+            render(oss);
+            cache.text = oss.str();
+            cache.indent = idt;
+            cache.flags = out.flags();
+            cache.precision = out.precision();
+            dirty_ = false;
+        }
+        out.write(cache.text.data(), static_cast<std::streamsize>(cache.text.size()));
+    }
+
+    // Writes a child of a container. Children of a caching container learn
+    // their parent, inherit the cache and are clean afterwards.
+    static void write_child(JsonNode &child,
+                            const std::shared_ptr<ParentLink> &parent,
+                            std::ostream &out,
+                            int idt)
+    {
+        if (parent) {
+            auto &links = child.parents_;
+            if (std::find(links.begin(), links.end(), parent) == links.end()) {
+                // drop parents that went away or stopped caching
+                links.erase(std::remove_if(links.begin(),
+                                           links.end(),
+                                           [](const std::shared_ptr<ParentLink> &link) {
+                                               return !link->node;
+                                           }),
+                            links.end());
+                links.push_back(parent);
             }
+            child.set_write_cache(true);
         }
-        oss << '"';
-        out << oss.str();
+        child.write(out, idt);
+        if (parent)
+            child.dirty_ = false;
     }
-    static void indent(std::ostream &out, int depth)
+
+    static void process_string(std::ostream &out, const std::string &origin)
     {
-        for (int i = 0; i < depth; i++)
-            out << '\t';
+        std::string escaped;
+        escaped.reserve(origin.size() + 2);
+        detail::append_escaped(escaped, origin);
+        out.write(escaped.data(), static_cast<std::streamsize>(escaped.size()));
     }
+    static void indent(std::ostream &out, int depth) { detail::write_indent(out, depth); }
 };
 
 struct JsonString : public JsonNode
@@ -117,10 +350,20 @@ struct JsonString : public JsonNode
     {
         this->type_ = JsonType::kString;
     }
+    JsonString(std::string &&str)
+        : str_(std::move(str))
+    {
+        this->type_ = JsonType::kString;
+    }
 
-    virtual JsonType get_type() final { return type_; }
+    virtual JsonType get_type() const final { return type_; }
     virtual void write(std::ostream &out, int indent = 0) final { process_string(out, str_); }
-    virtual std::string &get_string() final { return str_; }
+    virtual std::string &get_string() final
+    {
+        mark_dirty();
+        return str_;
+    }
+    virtual const std::string &get_string() const final { return str_; }
 };
 
 struct JsonDouble : public JsonNode
@@ -136,9 +379,14 @@ struct JsonDouble : public JsonNode
         this->type_ = JsonType::kNumber;
     }
 
-    virtual JsonType get_type() final { return type_; }
+    virtual JsonType get_type() const final { return type_; }
     virtual void write(std::ostream &out, int indent = 0) final { out << value_; }
-    virtual double &get_double() final { return value_; }
+    virtual double &get_double() final
+    {
+        mark_dirty();
+        return value_;
+    }
+    virtual const double &get_double() const final { return value_; }
 };
 
 struct JsonBool : public JsonNode
@@ -154,276 +402,4339 @@ struct JsonBool : public JsonNode
         this->type_ = JsonType::kBool;
     }
 
-    virtual JsonType get_type() final { return type_; }
+    virtual JsonType get_type() const final { return type_; }
     virtual void write(std::ostream &out, int indent = 0) final
     {
         out << (value_ ? "true" : "false");
     }
-    virtual bool &get_bool() final { return value_; }
+    virtual bool &get_bool() final
+    {
+        mark_dirty();
+        return value_;
+    }
+    virtual const bool &get_bool() const final { return value_; }
 };
 
+enum class JsonIndexKind : uint8_t { kHash, kSorted };
+
+class JsonArrayIndex;
+
 struct JsonArray : public JsonNode
 {
-private:
+protected:
+    // Indexes built on this array; copies of the array start without any.
+    struct IndexRegistry
+    {
+        std::vector<std::weak_ptr<JsonArrayIndex>> list;
+
+        IndexRegistry() = default;
+        IndexRegistry(const IndexRegistry &) {}
+        IndexRegistry &operator=(const IndexRegistry &) { return *this; }
+        inline ~IndexRegistry();
+    };
+
     std::vector<std::shared_ptr<JsonNode>> vec_;
+    WriteCache cache_;
+    IndexRegistry indexes_;
+
+    inline void invalidate_indexes();
+    // Makes vec_ hold the elements before it is changed directly.
+    virtual void box_elements() {}
 
 public:
     JsonArray() { this->type_ = JsonType::kArray; }
 
-    virtual void write(std::ostream &out, int idt = 0) final
+    virtual void write(std::ostream &out, int idt = 0)
+    {
+        write_cached(cache_, out, idt, [this, idt](std::ostream &o) {
+            detail::write_container(*this,
+                                    o,
+                                    idt,
+                                    [this](JsonNode &child, std::ostream &co, int i) {
+                                        write_child(child, cache_.self, co, i);
+                                    });
+        });
+    }
+    virtual JsonType get_type() const final { return type_; }
+    // Changes made through the returned vector make the indexes rebuild on
+    // their next lookup; append() and erase() update them in place.
+    virtual std::vector<std::shared_ptr<JsonNode>> &get_array()
+    {
+        mark_dirty();
+        if (!indexes_.list.empty())
+            invalidate_indexes();
+        return vec_;
+    }
+    virtual const std::vector<std::shared_ptr<JsonNode>> &get_array() const { return vec_; }
+    virtual void set_write_cache(bool enabled)
+    {
+        if (!enabled)
+            for (auto &child : vec_)
+                child->set_write_cache(false);
+        cache_.enable(enabled ? this : nullptr);
+    }
+
+    std::shared_ptr<JsonNode> &operator[](size_t index) { return get_array()[index]; }
+
+    // Builds an index over the elements keyed by the scalar at `path`, a JSON
+    // pointer relative to each element ("/id", "/user/name", "" for the
+    // element itself). The array keeps the index up to date while it is alive.
+    inline std::shared_ptr<JsonArrayIndex> create_index(const std::string &path,
+                                                        JsonIndexKind kind = JsonIndexKind::kHash);
+    inline void append(std::shared_ptr<JsonNode> element);
+    inline void erase(size_t index);
+};
+
+// Array made only of numbers, stored contiguously instead of one JsonDouble per
+// element. parse_json produces it for every non-empty all-number array; it is a
+// JsonArray, so code that casts to JsonArray keeps working.
+// get_numbers() exposes the values directly; get_array() still works but boxes
+// the values into JsonDouble nodes on first use. After a non-const get_array()
+// (or operator[], append(), erase()) the boxed nodes are what counts: the array
+// behaves like a plain JsonArray and get_numbers() throws.
+struct JsonNumberArray : public JsonArray
+{
+private:
+    std::vector<double> values_;
+    mutable std::vector<std::shared_ptr<JsonNode>> boxed_;
+    mutable std::atomic<bool> boxed_ready_{false}; // boxed_ mirrors values_
+    std::atomic<bool> values_valid_{true};         // values_ is authoritative, vec_ empty
+
+    static std::mutex &box_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+    // Fills boxed_; the caller holds box_mutex().
+    void box_locked() const
     {
-        out << '[';
-        if (vec_.empty()) {
-            out << (']');
+        if (boxed_ready_.load(std::memory_order_relaxed))
             return;
-        }
+        boxed_.reserve(values_.size());
+        for (double v : values_)
+            boxed_.push_back(std::make_shared<JsonDouble>(v));
+        boxed_ready_.store(true, std::memory_order_release);
+    }
+    // Const readers may box concurrently, so boxing is serialized.
+    void box() const
+    {
+        if (boxed_ready_.load(std::memory_order_acquire))
+            return;
+        std::lock_guard<std::mutex> lock(box_mutex());
+        box_locked();
+    }
+
+protected:
+    // Runs once even when several threads reach it through get_array().
+    virtual void box_elements()
+    {
+        if (!values_valid_.load(std::memory_order_acquire))
+            return;
+        std::lock_guard<std::mutex> lock(box_mutex());
+        if (!values_valid_.load(std::memory_order_relaxed))
+            return;
+        box_locked();
+        vec_ = std::move(boxed_);
+        boxed_.clear();
+        boxed_ready_.store(false, std::memory_order_relaxed);
+        std::vector<double>().swap(values_);
+        values_valid_.store(false, std::memory_order_release);
+    }
+
+public:
+    JsonNumberArray() = default;
+    JsonNumberArray(std::vector<double> values)
+        : values_(std::move(values))
+    {}
+    JsonNumberArray(const JsonNumberArray &other)
+        : JsonArray(other)
+        , values_(other.values_)
+        , boxed_(other.boxed_)
+        , boxed_ready_(other.boxed_ready_.load())
+        , values_valid_(other.values_valid_.load())
+    {}
 
-        bool first_element = true;
-        for (auto i = vec_.cbegin(); i != vec_.cend(); ++i) {
-            if (first_element) {
-                first_element = false;
+    // Writes the elements [begin, end) the way JsonArray::write writes
+    // JsonDouble children, including the separator before each of them.
+    void write_range(std::ostream &out, int idt, size_t begin, size_t end) const
+    {
+        // Format into one buffer when the stream uses default formatting, which
+        // is what operator<< would produce for each value anyway.
+        bool plain = (out.flags() & (std::ios::floatfield | std::ios::showpoint | std::ios::showpos
+                                     | std::ios::uppercase))
+                         == 0
+                     && out.width() == 0 && out.getloc() == std::locale::classic();
+        std::string buf;
+        char tmp[40];
+        for (size_t k = begin; k < end; ++k) {
+            if (k != 0)
+                buf.push_back(',');
+            buf.push_back('\n');
+            buf.append(static_cast<size_t>(idt), '\t');
+            if (plain) {
+                int n = std::snprintf(tmp,
+                                      sizeof(tmp),
+                                      "%.*g",
+                                      static_cast<int>(out.precision()),
+                                      values_[k]);
+                if (n >= 0 && static_cast<size_t>(n) < sizeof(tmp)) {
+                    buf.append(tmp, static_cast<size_t>(n));
+                } else {
+                    // too long for tmp at this precision
+                    out << buf << values_[k];
+                    buf.clear();
+                }
             } else {
-                out << ',';
+                out << buf << values_[k];
+                buf.clear();
+            }
+            if (buf.size() >= 16 * 1024) {
+                out << buf;
+                buf.clear();
             }
-            out << '\n';
-            indent(out, idt);
-            (*i)->write(out, idt + 1);
         }
-        out << '\n';
-        indent(out, idt);
-        out << ']';
+        out << buf;
     }
-    virtual JsonType get_type() final { return type_; }
-    virtual std::vector<std::shared_ptr<JsonNode>> &get_array() { return vec_; }
 
-    std::shared_ptr<JsonNode> &operator[](size_t index) { return vec_[index]; }
+    virtual std::vector<std::shared_ptr<JsonNode>> &get_array() final
+    {
+        box_elements();
+        return JsonArray::get_array();
+    }
+    virtual const std::vector<std::shared_ptr<JsonNode>> &get_array() const final
+    {
+        if (!values_valid_)
+            return vec_;
+        box();
+        return boxed_;
+    }
+    virtual std::vector<double> &get_numbers() final
+    {
+        mark_dirty();
+        if (!values_valid_)
+            throw std::runtime_error("The numeric array has been boxed by get_array()");
+        if (!indexes_.list.empty())
+            invalidate_indexes();
+        if (boxed_ready_.load(std::memory_order_relaxed)) {
+            // the values may change now, so the boxed copies go stale
+            boxed_.clear();
+            boxed_ready_.store(false, std::memory_order_relaxed);
+        }
+        return values_;
+    }
+    virtual const std::vector<double> &get_numbers() const final
+    {
+        if (!values_valid_)
+            throw std::runtime_error("The numeric array has been boxed by get_array()");
+        return values_;
+    }
+    virtual void set_write_cache(bool enabled) final
+    {
+        if (values_valid_)
+            cache_.enable(enabled ? this : nullptr);
+        else
+            JsonArray::set_write_cache(enabled);
+    }
+    bool boxed() const { return !values_valid_; }
 };
 
 struct JsonObject : public JsonNode
 {
 private:
     std::unordered_map<std::string, std::shared_ptr<JsonNode>> obj_;
+    WriteCache cache_;
 
 public:
     JsonObject() { this->type_ = JsonType::kObject; }
 
     virtual void write(std::ostream &out, int idt = 0) final
     {
-        out << '{';
-        if (obj_.empty()) {
-            out << ('}');
-            return;
-        }
-
-        bool first_element = true;
-        for (auto it = obj_.cbegin(); it != obj_.cend(); ++it) {
-            if (first_element) {
-                first_element = false;
-            } else {
-                out << ',';
-            }
-            out << '\n';
-            indent(out, idt);
-            process_string(out, it->first);
-            out << " : ";
-            it->second->write(out, idt + 1);
-        }
-
-        out << '\n';
-        indent(out, idt);
-        out << '}';
+        write_cached(cache_, out, idt, [this, idt](std::ostream &o) {
+            detail::write_container(*this,
+                                    o,
+                                    idt,
+                                    [this](JsonNode &child, std::ostream &co, int i) {
+                                        write_child(child, cache_.self, co, i);
+                                    });
+        });
     }
-    virtual JsonType get_type() final { return type_; }
+    virtual JsonType get_type() const final { return type_; }
     virtual std::unordered_map<std::string, std::shared_ptr<JsonNode>> &get_object()
     {
+        mark_dirty();
         return obj_;
     }
+    virtual const std::unordered_map<std::string, std::shared_ptr<JsonNode>> &get_object() const
+    {
+        return obj_;
+    }
+    virtual void set_write_cache(bool enabled)
+    {
+        if (!enabled)
+            for (auto &kv : obj_)
+                kv.second->set_write_cache(false);
+        cache_.enable(enabled ? this : nullptr);
+    }
 
-    std::shared_ptr<JsonNode> &operator[](const std::string &key) { return obj_[key]; }
+    std::shared_ptr<JsonNode> &operator[](const std::string &key)
+    {
+        mark_dirty();
+        return obj_[key];
+    }
 
     template<typename T>
     void insert(const std::string &key, T value)
     {
+        mark_dirty();
         obj_[key] = std::make_shared<T>(value);
     }
 };
 
-inline std::shared_ptr<JsonNode> parse_json(std::istream &in)
+NAMESPACE_BEGIN(detail)
+
+// Numeric arrays that are still unboxed are read as numbers so writing,
+// hashing and comparing them neither boxes them nor differs from a boxed array.
+inline const std::vector<double> *unboxed_values(const JsonNode &node)
+{
+    auto *numbers = dynamic_cast<const JsonNumberArray *>(&node);
+    return numbers && !numbers->boxed() ? &numbers->get_numbers() : nullptr;
+}
+
+// The layout of JsonNode::write, shared by every writer: children [begin, end)
+// of an array or object, each on its own line after its separator. `child`
+// writes a child node one level deeper.
+template<typename WriteChild>
+void write_children(const JsonNode &node,
+                    std::ostream &out,
+                    int idt,
+                    size_t begin,
+                    size_t end,
+                    WriteChild child)
 {
-    auto trim_whitespace = [&in]() -> char {
-        char letter;
-        in.get(letter);
-        while (letter == ' ' || letter == '\t' || letter == '\n' || letter == '\r') {
-            in.get(letter);
+    if (node.get_type() == JsonType::kArray) {
+        if (unboxed_values(node)) {
+            static_cast<const JsonNumberArray &>(node).write_range(out, idt, begin, end);
+            return;
         }
-        return letter;
-    };
+        auto &vec = node.get_array();
+        for (size_t k = begin; k < end; ++k) {
+            out << (k ? ",\n" : "\n");
+            write_indent(out, idt);
+            child(*vec[k], out, idt + 1);
+        }
+        return;
+    }
+    auto it = node.get_object().begin();
+    std::advance(it, begin);
+    for (size_t k = begin; k < end; ++k, ++it) {
+        out << (k ? ",\n" : "\n");
+        write_indent(out, idt);
+        write_key(out, it->first);
+        child(*it->second, out, idt + 1);
+    }
+}
 
-    auto parse_string = [&in]() -> std::string {
-        char letter;
-        in.get(letter);
-        std::stringstream oss;
-        while (letter != '"') //the end of string
-        {
-            if (letter == '\\') {
-                char p = static_cast<char>(in.get());
-                switch (p) {
+// A whole array or object, brackets included.
+template<typename WriteChild>
+void write_container(const JsonNode &node, std::ostream &out, int idt, WriteChild child)
+{
+    bool array = node.get_type() == JsonType::kArray;
+    auto *values = unboxed_values(node);
+    size_t size = values ? values->size()
+                         : (array ? node.get_array().size() : node.get_object().size());
+    out << (array ? '[' : '{');
+    if (size != 0) {
+        write_children(node, out, idt, 0, size, child);
+        out << '\n';
+        write_indent(out, idt);
+    }
+    out << (array ? ']' : '}');
+}
+
+// Writes a tree through its const accessors only, so it neither touches write
+// caches nor boxes numeric arrays and may run on any number of threads.
+inline void write_node(const JsonNode &node, std::ostream &out, int idt)
+{
+    switch (node.get_type()) {
+    case JsonType::kNull:
+        out << "null";
+        break;
+    case JsonType::kBool:
+        out << (node.get_bool() ? "true" : "false");
+        break;
+    case JsonType::kNumber:
+        out << node.get_double();
+        break;
+    case JsonType::kString: {
+        std::string escaped;
+        append_escaped(escaped, node.get_string());
+        out.write(escaped.data(), static_cast<std::streamsize>(escaped.size()));
+        break;
+    }
+    default:
+        write_container(node, out, idt, [](const JsonNode &child, std::ostream &o, int i) {
+            write_node(child, o, i);
+        });
+        break;
+    }
+}
+
+// Character level scanner shared by the parsers in this file. It reads straight
+// from the stream buffer, and read_* functions always stop at the first char
+// after the element they parsed, leaving the rest of the stream untouched.
+class Scanner
+{
+public:
+    explicit Scanner(std::istream &in)
+        : in_(in)
+        , buf_(in.rdbuf())
+    {
+        if (!buf_)
+            throw std::runtime_error("Parser got a stream without buffer");
+    }
+
+    // Skips whitespace and returns the next char without consuming it, or EOF.
+    int peek()
+    {
+        int c = buf_->sgetc();
+        while (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            c = buf_->snextc();
+        if (c == EOF)
+            in_.setstate(std::ios::eofbit);
+        return c;
+    }
+    void bump() { buf_->sbumpc(); }
+
+    // Skips whitespace and consumes `c`, or throws.
+    void expect(char c, const char *message)
+    {
+        if (peek() != c)
+            throw std::runtime_error(message);
+        bump();
+    }
+
+    // Consumes `word` (e.g. "true") starting at the current char.
+    void read_literal(const char *word)
+    {
+        for (const char *p = word; *p; ++p) {
+            if (buf_->sbumpc() != *p)
+                throw std::runtime_error(std::string("Invalid input when parsing '") + word + "'");
+        }
+    }
+
+    // Reads a string whose opening quote has already been consumed and appends
+    // its unescaped content to `out`.
+    template<typename String>
+    void read_string(String &out)
+    {
+        for (;;) {
+            int c = buf_->sbumpc();
+            if (c == '"')
+                return;
+            if (c == EOF)
+                throw std::runtime_error("Unterminated string");
+            if (c != '\\') {
+                out.push_back(static_cast<char>(c));
+                continue;
+            }
+            int p = buf_->sbumpc();
+            switch (p) {
+            case '"':
+                out.push_back('"');
+                break;
+            case 'n':
+                out.push_back('\n');
+                break;
+            case '/':
+                out.push_back('/');
+                break;
+            case '\\':
+                out.push_back('\\');
+                break;
+            case 'b':
+                out.push_back('\b');
+                break;
+            case 'f':
+                out.push_back('\f');
+                break;
+            case 'r':
+                out.push_back('\r');
+                break;
+            case 't':
+                out.push_back('\t');
+                break;
+            case 'u':
+                append_utf8(out, read_code_point());
+                break;
+            default:
+                throw std::runtime_error(std::string("When parsing string INVALID char ")
+                                         + static_cast<char>(p));
+            }
+        }
+    }
+
+    // Skips one value without decoding it. Only quotes, escapes and bracket
+    // depth are tracked, so numbers and nested structure are not validated.
+    void skip_value()
+    {
+        int c = peek();
+        if (c == '"') {
+            bump();
+            skip_string();
+            return;
+        }
+        if (c == '[' || c == '{') {
+            size_t depth = 0;
+            for (;;) {
+                c = buf_->sbumpc();
+                switch (c) {
                 case '"':
-                    oss << '"';
-                    break;
-                case 'n':
-                    oss << '\n';
+                    skip_string();
                     break;
-                case '/':
-                    oss << '\/';
+                case '[':
+                case '{':
+                    ++depth;
                     break;
-                case '\\':
-                    oss << '\\';
-                    break;
-                case 'b':
-                    oss << '\b';
-                    break;
-                case 'f':
-                    oss << '\f';
-                    break;
-                case 'r':
-                    oss << '\r';
-                    break;
-                case 't':
-                    oss << '\t';
+                case ']':
+                case '}':
+                    if (--depth == 0)
+                        return;
                     break;
+                case EOF:
+                    throw std::runtime_error("Parser found unexpected end of input");
                 default:
-                    throw std::runtime_error("When parsing string INVALID char" + p);
+                    break;
                 }
-            } else {
-                oss << letter;
             }
-            in.get(letter);
         }
-        return oss.str();
-    };
-
-    auto parse_double = [&in]() -> double {
-        //WARNING:
-        //No error checking here
-        // std::stringstream will handle some usual errors, for example, "1.x"  will be converted to "1.0" but the
-        // stream will stay at char 'x' so it's still an erroe parsing.
-        // I don't care who the f**k inputs invaild values
-        std::stringstream ins;
-        double res;
-        in.unget();
-
-        char p = static_cast<char>(in.get());
-        while (
-            (!in.fail()) //a nice pitfall (when in.get() failed,p will be set as zero so without it this is a deadloop))
-            && (p == '-' || p == 'e' || p == 'E' || p == '.' || p == ',' || p == '+' || p == '-'
-                || (p >= '0' && p <= '9'))) {
-            ins << p;
-            in.get(p);
-        }
-        // [...1.0,{...] when the loop ends, char p has ',' value, and the stream 'in' now points at
-        // char '{' which is incorrect. The designation is parse_* functions will always ends at the
-        // first char after the element parsed.
-        // So the following line is needed.
-        in.unget();
-        ins >> res;
-        return res;
-    };
+        if (c != '-' && (c < '0' || c > '9') && c != 't' && c != 'f' && c != 'n')
+            throw std::runtime_error(c == EOF ? std::string("Parser found unexpected end of input")
+                                              : std::string("Parser found unexpected character ")
+                                                    + static_cast<char>(c));
+        while (c != EOF && c != ',' && c != ']' && c != '}' && c != ' ' && c != '\t' && c != '\n'
+               && c != '\r')
+            c = buf_->snextc();
+    }
 
-    auto parse_bool = [&in]() -> bool {
-        in.unget();
-        char p;
-        in.get(p);
-        if (p == 't') {
-            if (in.get() == 'r' && in.get() == 'u' && in.get() == 'e') {
-                return true;
+    // Reads a number starting at the current char.
+    double read_number()
+    {
+        // Numbers are collected on the stack; only unusually long ones spill
+        // into scratch_, so parsing numbers does not allocate.
+        char small[64];
+        size_t n = 0;
+        scratch_.clear();
+        int c = buf_->sgetc();
+        while (c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= '0' && c <= '9')) {
+            if (scratch_.empty() && n < sizeof(small) - 1) {
+                small[n++] = static_cast<char>(c);
             } else {
-                throw std::runtime_error("Invalid input when parsing bool 'true'");
-            }
-        } else {
-            {
-                if (in.get() == 'a' && in.get() == 'l' && in.get() == 's' && in.get() == 'e') {
-                    return false;
-                } else {
-                    throw std::runtime_error("Invalid input when parsing bool 'false'");
-                }
+                if (scratch_.empty())
+                    scratch_.assign(small, n);
+                scratch_.push_back(static_cast<char>(c));
             }
+            c = buf_->snextc();
         }
-    };
-
-    char letter = trim_whitespace(); //first_not_white_letter
-                                     //    if (letter == 0 || letter == EOF) {
-    if (!in.good()) {
-        return std::make_shared<JsonNode>();
+        small[n] = '\0';
+        const char *text = scratch_.empty() ? small : scratch_.c_str();
+        size_t size = scratch_.empty() ? n : scratch_.size();
+        char *end = nullptr;
+        double res = std::strtod(text, &end);
+        if (size == 0 || end != text + size)
+            throw std::runtime_error("Invalid number '" + std::string(text, size) + "'");
+        return res;
     }
 
-    if (letter == '"') //string begins
+private:
+    std::istream &in_;
+    std::streambuf *buf_;
+    std::string scratch_;
+
+    void skip_string()
     {
-        return std::make_shared<JsonString>(parse_string());
+        for (;;) {
+            int c = buf_->sbumpc();
+            if (c == '"')
+                return;
+            if (c == '\\')
+                c = buf_->sbumpc();
+            if (c == EOF)
+                throw std::runtime_error("Unterminated string");
+        }
     }
-    //double
-    else if (letter == '-' || (letter >= '0' && letter <= '9')) {
-        return std::make_shared<JsonDouble>(parse_double());
+
+    unsigned read_hex4()
+    {
+        unsigned code = 0;
+        for (int i = 0; i < 4; i++) {
+            int c = buf_->sbumpc();
+            code <<= 4;
+            if (c >= '0' && c <= '9')
+                code |= static_cast<unsigned>(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                code |= static_cast<unsigned>(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                code |= static_cast<unsigned>(c - 'A' + 10);
+            else
+                throw std::runtime_error("Invalid \\u escape in string");
+        }
+        return code;
     }
-    //bool
-    else if (letter == 't' || letter == 'f') {
-        return std::make_shared<JsonBool>(parse_bool());
+
+    unsigned read_code_point()
+    {
+        unsigned code = read_hex4();
+        if (code >= 0xD800 && code <= 0xDBFF) {
+            if (buf_->sbumpc() != '\\' || buf_->sbumpc() != 'u')
+                throw std::runtime_error("Unpaired surrogate in string");
+            unsigned low = read_hex4();
+            if (low < 0xDC00 || low > 0xDFFF)
+                throw std::runtime_error("Unpaired surrogate in string");
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        }
+        return code;
     }
-    //null
-    else if (letter == 'n') {
-        if (in.get() == 'u' && in.get() == 'l' && in.get() == 'l') {
-            return std::make_shared<JsonNode>();
+
+    template<typename String>
+    static void append_utf8(String &out, unsigned code)
+    {
+        if (code < 0x80) {
+            out.push_back(static_cast<char>(code));
+        } else if (code < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        } else if (code < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
         } else {
-            throw std::runtime_error("Invalid input when parsing 'null'");
+            out.push_back(static_cast<char>(0xF0 | (code >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
         }
     }
-    // array
-    else if (letter == '[') {
-        auto res = std::make_shared<JsonArray>();
+};
 
-        do {
-            letter = trim_whitespace();
-            if (letter == ',') {
-                letter = trim_whitespace(); //move to next char which is not whitespace
-            }
-            in.unget();
-            res->get_array().push_back(parse_json(in));
+inline std::runtime_error unexpected_char(int c)
+{
+    if (c == EOF)
+        return std::runtime_error("Parser found unexpected end of input");
+    return std::runtime_error(std::string("Parser found unexpected character ")
+                              + static_cast<char>(c));
+}
 
-            letter = in.peek(); //get the current stream char without extracting it from the stream
-        } while (letter != ']');
-        //now in is at ']'
-        //pass it mannually
-        in.get();
-        return std::move(res);
+inline std::shared_ptr<JsonNode> parse_node(Scanner &sc);
+
+// Parses the remaining elements of a non-empty array into `res`.
+inline std::shared_ptr<JsonNode> parse_elements(Scanner &sc, std::shared_ptr<JsonArray> res)
+{
+    auto &vec = res->get_array();
+    for (;;) {
+        vec.push_back(parse_node(sc));
+        int letter = sc.peek();
+        sc.bump();
+        if (letter == ']')
+            return std::move(res);
+        if (letter != ',')
+            throw unexpected_char(letter);
+    }
+}
+
+inline std::shared_ptr<JsonNode> parse_node(Scanner &sc)
+{
+    int letter = sc.peek();
+    switch (letter) {
+    case '"': {
+        sc.bump();
+        std::string str;
+        sc.read_string(str);
+        return std::make_shared<JsonString>(std::move(str));
+    }
+    case 't':
+        sc.read_literal("true");
+        return std::make_shared<JsonBool>(true);
+    case 'f':
+        sc.read_literal("false");
+        return std::make_shared<JsonBool>(false);
+    case 'n':
+        sc.read_literal("null");
+        return std::make_shared<JsonNode>();
+    case '[': {
+        sc.bump();
+        letter = sc.peek();
+        if (letter == '-' || (letter >= '0' && letter <= '9')) {
+            // collect leading numbers contiguously; most numeric arrays end here
+            std::vector<double> numbers;
+            for (;;) {
+                numbers.push_back(sc.read_number());
+                letter = sc.peek();
+                sc.bump();
+                if (letter == ']')
+                    return std::make_shared<JsonNumberArray>(std::move(numbers));
+                if (letter != ',')
+                    throw unexpected_char(letter);
+                letter = sc.peek();
+                if (letter != '-' && (letter < '0' || letter > '9'))
+                    break;
+            }
+            auto res = std::make_shared<JsonArray>();
+            auto &vec = res->get_array();
+            for (double v : numbers)
+                vec.push_back(std::make_shared<JsonDouble>(v));
+            return parse_elements(sc, std::move(res));
+        }
+        auto res = std::make_shared<JsonArray>();
+        if (letter == ']') {
+            sc.bump();
+            return std::move(res);
+        }
+        return parse_elements(sc, std::move(res));
+    }
+    case '{': {
+        sc.bump();
+        auto res = std::make_shared<JsonObject>();
+        auto &obj = res->get_object();
+        if (sc.peek() == '}') {
+            sc.bump();
+            return std::move(res);
+        }
+        for (;;) {
+            sc.expect('"', "When Parsing object a key is expected");
+            std::string key;
+            sc.read_string(key);
+            sc.expect(':', "When Parsing object an ':' missed");
+            obj[std::move(key)] = parse_node(sc);
+            letter = sc.peek();
+            sc.bump();
+            if (letter == '}')
+                return std::move(res);
+            if (letter != ',')
+                throw unexpected_char(letter);
+        }
+    }
+    default:
+        if (letter == '-' || (letter >= '0' && letter <= '9'))
+            return std::make_shared<JsonDouble>(sc.read_number());
+        throw unexpected_char(letter);
+    }
+}
+
+// Splits a JSON pointer (RFC 6901) such as "/user/id" into unescaped tokens.
+// The empty pointer "" refers to the whole document and yields no tokens.
+inline std::vector<std::string> split_pointer(const std::string &pointer)
+{
+    std::vector<std::string> tokens;
+    if (pointer.empty())
+        return tokens;
+    if (pointer[0] != '/')
+        throw std::runtime_error("JSON pointer must start with '/': " + pointer);
+    std::string token;
+    for (size_t i = 1; i <= pointer.size(); ++i) {
+        if (i == pointer.size() || pointer[i] == '/') {
+            tokens.push_back(token);
+            token.clear();
+        } else if (pointer[i] == '~') {
+            char next = i + 1 < pointer.size() ? pointer[i + 1] : '\0';
+            if (next != '0' && next != '1')
+                throw std::runtime_error("Invalid escape in JSON pointer: " + pointer);
+            token.push_back(next == '0' ? '~' : '/');
+            ++i;
+        } else {
+            token.push_back(pointer[i]);
+        }
+    }
+    return tokens;
+}
+
+// Appends `token` to a JSON pointer, escaping it.
+inline void append_pointer_token(std::string &path, const std::string &token)
+{
+    path += '/';
+    for (char c : token) {
+        if (c == '~')
+            path += "~0";
+        else if (c == '/')
+            path += "~1";
+        else
+            path += c;
+    }
+}
+
+NAMESPACE_END(detail)
+
+// Parses one value from `in` and leaves the stream at the first char after it.
+// An empty input yields a null node.
+inline std::shared_ptr<JsonNode> parse_json(std::istream &in)
+{
+    detail::Scanner sc(in);
+    if (sc.peek() == EOF)
+        return std::make_shared<JsonNode>();
+    return detail::parse_node(sc);
+}
+
+// Set of JSON pointers selecting the parts of a document parse_json should
+// build, e.g. {"/user/id", "/event/ts"}. A "*" token matches every member or
+// element at that level. Everything else is skipped with a byte scan.
+class JsonProjection
+{
+public:
+    JsonProjection() = default;
+    JsonProjection(std::initializer_list<std::string> pointers)
+    {
+        for (auto &p : pointers)
+            add(p);
+    }
+
+    JsonProjection &add(const std::string &pointer)
+    {
+        insert(root_, detail::split_pointer(pointer), 0);
+        return *this;
+    }
+
+    std::shared_ptr<JsonNode> parse(std::istream &in) const
+    {
+        detail::Scanner sc(in);
+        if (sc.peek() == EOF)
+            return std::make_shared<JsonNode>();
+        auto res = parse(sc, root_);
+        return res ? res : std::make_shared<JsonNode>();
+    }
+
+private:
+    struct Trie
+    {
+        bool terminal = false; // the whole subtree is wanted
+        std::unordered_map<std::string, std::unique_ptr<Trie>> children;
+        std::unique_ptr<Trie> any;
+
+        // Named children also hold everything `any` selects, so this is the
+        // whole selection for `token`.
+        const Trie *find(const std::string &token) const
+        {
+            auto it = children.find(token);
+            return it != children.end() ? it->second.get() : any.get();
+        }
+    };
+
+    Trie root_;
+
+    static std::unique_ptr<Trie> copy(const Trie &t)
+    {
+        std::unique_ptr<Trie> res(new Trie);
+        res->terminal = t.terminal;
+        for (auto &kv : t.children)
+            res->children[kv.first] = copy(*kv.second);
+        if (t.any)
+            res->any = copy(*t.any);
+        return res;
+    }
+
+    // A "*" token goes into `any` and into every named child; a new named
+    // child starts as a copy of `any`.
+    static void insert(Trie &t, const std::vector<std::string> &tokens, size_t i)
+    {
+        if (i == tokens.size()) {
+            t.terminal = true;
+            return;
+        }
+        if (tokens[i] == "*") {
+            if (!t.any)
+                t.any.reset(new Trie);
+            insert(*t.any, tokens, i + 1);
+            for (auto &kv : t.children)
+                insert(*kv.second, tokens, i + 1);
+            return;
+        }
+        auto &child = t.children[tokens[i]];
+        if (!child)
+            child = t.any ? copy(*t.any) : std::unique_ptr<Trie>(new Trie);
+        insert(*child, tokens, i + 1);
+    }
+
+    // Returns nullptr when the value is a scalar but the projection wants
+    // something inside it.
+    static std::shared_ptr<JsonNode> parse(detail::Scanner &sc, const Trie &t)
+    {
+        if (t.terminal)
+            return detail::parse_node(sc);
+
+        int letter = sc.peek();
+        if (letter == '[') {
+            sc.bump();
+            auto res = std::make_shared<JsonArray>();
+            auto &vec = res->get_array();
+            if (sc.peek() == ']') {
+                sc.bump();
+                return std::move(res);
+            }
+            for (size_t i = 0;; ++i) {
+                const Trie *child = t.children.empty() ? t.any.get() : t.find(std::to_string(i));
+                std::shared_ptr<JsonNode> value;
+                if (child)
+                    value = parse(sc, *child);
+                else
+                    sc.skip_value();
+                // skipped elements stay as null so indices keep their meaning
+                vec.push_back(value ? value : std::make_shared<JsonNode>());
+                letter = sc.peek();
+                sc.bump();
+                if (letter == ']')
+                    return std::move(res);
+                if (letter != ',')
+                    throw detail::unexpected_char(letter);
+            }
+        }
+        if (letter == '{') {
+            sc.bump();
+            auto res = std::make_shared<JsonObject>();
+            auto &obj = res->get_object();
+            if (sc.peek() == '}') {
+                sc.bump();
+                return std::move(res);
+            }
+            std::string key;
+            for (;;) {
+                sc.expect('"', "When Parsing object a key is expected");
+                key.clear();
+                sc.read_string(key);
+                sc.expect(':', "When Parsing object an ':' missed");
+                const Trie *child = t.find(key);
+                std::shared_ptr<JsonNode> value;
+                if (child)
+                    value = parse(sc, *child);
+                else
+                    sc.skip_value();
+                if (value)
+                    obj[key] = std::move(value);
+                letter = sc.peek();
+                sc.bump();
+                if (letter == '}')
+                    return std::move(res);
+                if (letter != ',')
+                    throw detail::unexpected_char(letter);
+            }
+        }
+        sc.skip_value();
+        return nullptr;
+    }
+};
+
+// Builds only the parts of the document selected by `projection`. Members that
+// are not selected are left out of objects, array elements that are not
+// selected are kept as null so the remaining indices are unchanged.
+inline std::shared_ptr<JsonNode> parse_json(std::istream &in, const JsonProjection &projection)
+{
+    return projection.parse(in);
+}
+
+// Scalar an array index is keyed by. Keys of different types never compare
+// equal; in a sorted index null < bool < number < string.
+struct JsonIndexKey
+{
+    JsonType type = JsonType::kNull;
+    double number = 0; // also holds bools as 0/1
+    std::string string;
+
+    JsonIndexKey() = default;
+    JsonIndexKey(std::nullptr_t) {}
+    JsonIndexKey(bool value)
+        : type(JsonType::kBool)
+        , number(value ? 1 : 0)
+    {}
+    template<typename T,
+             typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                                     int>::type
+             = 0>
+    JsonIndexKey(T value)
+        : type(JsonType::kNumber)
+        , number(static_cast<double>(value) == 0 ? 0.0 : static_cast<double>(value))
+    {}
+    JsonIndexKey(const char *value)
+        : type(JsonType::kString)
+        , string(value)
+    {}
+    JsonIndexKey(std::string value)
+        : type(JsonType::kString)
+        , string(std::move(value))
+    {}
+
+    bool operator==(const JsonIndexKey &other) const
+    {
+        return type == other.type && number == other.number && string == other.string;
+    }
+    bool operator<(const JsonIndexKey &other) const
+    {
+        if (type != other.type)
+            return type < other.type;
+        if (type == JsonType::kString)
+            return string < other.string;
+        return number < other.number;
+    }
+    size_t hash() const
+    {
+        size_t h = type == JsonType::kString ? std::hash<std::string>()(string)
+                                             : std::hash<double>()(number);
+        return h ^ (static_cast<size_t>(type) * 0x9e3779b9u);
+    }
+};
+
+// Hash or sorted index over an array of objects, e.g. the orders by "/id".
+// Created by JsonArray::create_index(). Elements whose path is missing or
+// leads to an array/object are not indexed. append() and erase() on the array
+// update the index directly; other changes to the array make it rebuild on the
+// next lookup. Changing the key inside an element is not seen, call rebuild()
+// afterwards. Lookups may run concurrently, but not together with changes.
+class JsonArrayIndex
+{
+public:
+    JsonArrayIndex(const JsonArrayIndex &) = delete;
+    JsonArrayIndex &operator=(const JsonArrayIndex &) = delete;
+
+    JsonIndexKind kind() const { return kind_; }
+    const std::string &path() const { return path_; }
+
+    // Number of indexed elements.
+    size_t size() const
+    {
+        refresh();
+        return kind_ == JsonIndexKind::kHash ? hash_.size() : sorted_.size();
+    }
+
+    // Some element with the key, or nullptr.
+    std::shared_ptr<JsonNode> find(const JsonIndexKey &key) const
+    {
+        refresh();
+        if (kind_ == JsonIndexKind::kHash) {
+            auto it = hash_.find(key);
+            return it == hash_.end() ? nullptr : it->second;
+        }
+        auto it = sorted_.find(key);
+        return it == sorted_.end() ? nullptr : it->second;
+    }
+
+    std::vector<std::shared_ptr<JsonNode>> find_all(const JsonIndexKey &key) const
+    {
+        refresh();
+        std::vector<std::shared_ptr<JsonNode>> res;
+        if (kind_ == JsonIndexKind::kHash) {
+            auto range = hash_.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it)
+                res.push_back(it->second);
+        } else {
+            auto range = sorted_.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it)
+                res.push_back(it->second);
+        }
+        return res;
+    }
+
+    // Elements with lo <= key <= hi in key order. Only sorted indexes.
+    std::vector<std::shared_ptr<JsonNode>> range(const JsonIndexKey &lo,
+                                                 const JsonIndexKey &hi) const
+    {
+        if (kind_ != JsonIndexKind::kSorted)
+            throw std::runtime_error("Range scans need a sorted index");
+        refresh();
+        std::vector<std::shared_ptr<JsonNode>> res;
+        for (auto it = sorted_.lower_bound(lo); it != sorted_.end() && !(hi < it->first); ++it)
+            res.push_back(it->second);
+        return res;
+    }
+
+    // Re-reads every element. Does nothing once the array is gone.
+    void rebuild()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rebuild_locked();
+    }
+
+private:
+    friend struct JsonArray;
+
+    struct KeyHash
+    {
+        size_t operator()(const JsonIndexKey &key) const { return key.hash(); }
+    };
+
+    JsonIndexKind kind_;
+    std::string path_;
+    std::vector<std::string> tokens_;
+    const JsonArray *array_; // reset by the array's destructor
+    mutable std::unordered_multimap<JsonIndexKey, std::shared_ptr<JsonNode>, KeyHash> hash_;
+    mutable std::multimap<JsonIndexKey, std::shared_ptr<JsonNode>> sorted_;
+    mutable std::atomic<bool> stale_{true};
+    mutable std::mutex mutex_;
+
+    JsonArrayIndex(const JsonArray *array, const std::string &path, JsonIndexKind kind)
+        : kind_(kind)
+        , path_(path)
+        , tokens_(detail::split_pointer(path))
+        , array_(array)
+    {}
+
+    void refresh() const
+    {
+        if (!stale_.load(std::memory_order_acquire))
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stale_.load(std::memory_order_relaxed))
+            const_cast<JsonArrayIndex *>(this)->rebuild_locked();
+    }
+
+    void rebuild_locked()
+    {
+        if (!array_)
+            return;
+        hash_.clear();
+        sorted_.clear();
+        for (auto &element : array_->get_array())
+            add(element);
+        stale_.store(false, std::memory_order_release);
+    }
+
+    bool key_of(const JsonNode &element, JsonIndexKey &key) const
+    {
+        const JsonNode *node = &element;
+        for (auto &token : tokens_) {
+            if (node->get_type() == JsonType::kObject) {
+                auto &obj = node->get_object();
+                auto it = obj.find(token);
+                if (it == obj.end())
+                    return false;
+                node = it->second.get();
+            } else if (node->get_type() == JsonType::kArray) {
+                auto &vec = node->get_array();
+                char *end = nullptr;
+                unsigned long i = std::strtoul(token.c_str(), &end, 10);
+                if (token.empty() || *end != '\0' || i >= vec.size())
+                    return false;
+                node = vec[i].get();
+            } else {
+                return false;
+            }
+        }
+        switch (node->get_type()) {
+        case JsonType::kNull:
+            key = JsonIndexKey();
+            return true;
+        case JsonType::kBool:
+            key = JsonIndexKey(node->get_bool());
+            return true;
+        case JsonType::kNumber:
+            key = JsonIndexKey(node->get_double());
+            return true;
+        case JsonType::kString:
+            key = JsonIndexKey(node->get_string());
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void add(const std::shared_ptr<JsonNode> &element)
+    {
+        JsonIndexKey key;
+        if (!element || !key_of(*element, key))
+            return;
+        if (kind_ == JsonIndexKind::kHash)
+            hash_.emplace(std::move(key), element);
+        else
+            sorted_.emplace(std::move(key), element);
+    }
+
+    void remove(const std::shared_ptr<JsonNode> &element)
+    {
+        JsonIndexKey key;
+        if (!element || !key_of(*element, key))
+            return;
+        if (kind_ == JsonIndexKind::kHash) {
+            auto range = hash_.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it)
+                if (it->second == element) {
+                    hash_.erase(it);
+                    return;
+                }
+        } else {
+            auto range = sorted_.equal_range(key);
+            for (auto it = range.first; it != range.second; ++it)
+                if (it->second == element) {
+                    sorted_.erase(it);
+                    return;
+                }
+        }
+    }
+};
+
+inline JsonArray::IndexRegistry::~IndexRegistry()
+{
+    for (auto &weak : list)
+        if (auto index = weak.lock()) {
+            std::lock_guard<std::mutex> lock(index->mutex_);
+            index->array_ = nullptr;
+        }
+}
+
+inline void JsonArray::invalidate_indexes()
+{
+    for (auto &weak : indexes_.list)
+        if (auto index = weak.lock())
+            index->stale_.store(true, std::memory_order_release);
+}
+
+inline std::shared_ptr<JsonArrayIndex> JsonArray::create_index(const std::string &path,
+                                                               JsonIndexKind kind)
+{
+    std::shared_ptr<JsonArrayIndex> index(new JsonArrayIndex(this, path, kind));
+    index->rebuild();
+    auto &list = indexes_.list;
+    list.erase(std::remove_if(list.begin(),
+                              list.end(),
+                              [](const std::weak_ptr<JsonArrayIndex> &weak) {
+                                  return weak.expired();
+                              }),
+               list.end());
+    list.push_back(index);
+    return index;
+}
+
+inline void JsonArray::append(std::shared_ptr<JsonNode> element)
+{
+    box_elements();
+    mark_dirty();
+    for (auto &weak : indexes_.list)
+        if (auto index = weak.lock())
+            if (!index->stale_.load(std::memory_order_relaxed))
+                index->add(element);
+    vec_.push_back(std::move(element));
+}
+
+inline void JsonArray::erase(size_t index)
+{
+    box_elements();
+    if (index >= vec_.size())
+        throw std::runtime_error("Array index out of range");
+    mark_dirty();
+    for (auto &weak : indexes_.list)
+        if (auto idx = weak.lock())
+            if (!idx->stale_.load(std::memory_order_relaxed))
+                idx->remove(vec_[index]);
+    vec_.erase(vec_.begin() + static_cast<std::ptrdiff_t>(index));
+}
+
+// Source of memory for JsonDocument, modelled after std::pmr::memory_resource
+// so the library keeps building as C++11. With C++17, PmrResource adapts any
+// std::pmr::memory_resource.
+class MemoryResource
+{
+public:
+    virtual ~MemoryResource() = default;
+
+    void *allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+    {
+        return do_allocate(bytes, alignment);
+    }
+    void deallocate(void *p, size_t bytes, size_t alignment = alignof(std::max_align_t))
+    {
+        do_deallocate(p, bytes, alignment);
+    }
+    bool is_equal(const MemoryResource &other) const noexcept { return do_is_equal(other); }
+
+protected:
+    virtual void *do_allocate(size_t bytes, size_t alignment) = 0;
+    virtual void do_deallocate(void *p, size_t bytes, size_t alignment) = 0;
+    virtual bool do_is_equal(const MemoryResource &other) const noexcept { return this == &other; }
+};
+
+NAMESPACE_BEGIN(detail)
+
+class NewDeleteResource : public MemoryResource
+{
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (alignment > alignof(std::max_align_t))
+            throw std::bad_alloc();
+        return ::operator new(bytes);
+    }
+    void do_deallocate(void *p, size_t, size_t) override { ::operator delete(p); }
+    bool do_is_equal(const MemoryResource &other) const noexcept override
+    {
+        return dynamic_cast<const NewDeleteResource *>(&other) != nullptr;
+    }
+};
+
+NAMESPACE_END(detail)
+
+inline MemoryResource *new_delete_resource()
+{
+    static detail::NewDeleteResource resource;
+    return &resource;
+}
+
+// Arena which hands out memory from growing blocks and frees everything at once
+// in release() or on destruction; deallocate() is a no-op. Not thread-safe.
+class MonotonicResource : public MemoryResource
+{
+public:
+    explicit MonotonicResource(size_t initial_size = 4096,
+                               MemoryResource *upstream = new_delete_resource())
+        : upstream_(upstream)
+        , next_size_(initial_size < 64 ? 64 : initial_size)
+    {}
+
+    // Serves allocations from `buffer` first; the buffer is never freed.
+    MonotonicResource(void *buffer, size_t size, MemoryResource *upstream = new_delete_resource())
+        : upstream_(upstream)
+        , cur_(static_cast<char *>(buffer))
+        , end_(static_cast<char *>(buffer) + size)
+        , next_size_(size < 64 ? 64 : size)
+    {}
+
+    MonotonicResource(const MonotonicResource &) = delete;
+    MonotonicResource &operator=(const MonotonicResource &) = delete;
+    ~MonotonicResource() { release(); }
+
+    // Returns every block to the upstream resource.
+    void release()
+    {
+        while (blocks_) {
+            Block *next = blocks_->next;
+            upstream_->deallocate(blocks_, blocks_->size);
+            blocks_ = next;
+        }
+        cur_ = end_ = nullptr;
+    }
+
+    MemoryResource *upstream() const { return upstream_; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        char *p = align(cur_, alignment);
+        if (!p || p + bytes > end_) {
+            grow(bytes + alignment);
+            p = align(cur_, alignment);
+        }
+        cur_ = p + bytes;
+        return p;
+    }
+    void do_deallocate(void *, size_t, size_t) override {}
+
+private:
+    struct Block
+    {
+        Block *next;
+        size_t size;
+    };
+
+    MemoryResource *upstream_;
+    Block *blocks_ = nullptr;
+    char *cur_ = nullptr;
+    char *end_ = nullptr;
+    size_t next_size_;
+
+    static char *align(char *p, size_t alignment)
+    {
+        if (!p)
+            return nullptr;
+        uintptr_t v = reinterpret_cast<uintptr_t>(p);
+        return p + ((alignment - v % alignment) % alignment);
+    }
+
+    void grow(size_t min_bytes)
+    {
+        size_t size = next_size_;
+        while (size < min_bytes + sizeof(Block))
+            size *= 2;
+        Block *block = static_cast<Block *>(upstream_->allocate(size));
+        block->next = blocks_;
+        block->size = size;
+        blocks_ = block;
+        cur_ = reinterpret_cast<char *>(block + 1);
+        end_ = reinterpret_cast<char *>(block) + size;
+        next_size_ = size * 2;
+    }
+};
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#define PDJSON_HAS_PMR 1
+// Lets a std::pmr::memory_resource back a JsonDocument.
+class PmrResource : public MemoryResource
+{
+public:
+    explicit PmrResource(std::pmr::memory_resource *upstream)
+        : upstream_(upstream)
+    {}
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        return upstream_->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        upstream_->deallocate(p, bytes, alignment);
+    }
+
+private:
+    std::pmr::memory_resource *upstream_;
+};
+#endif
+#endif
+
+// Allocator handing out memory from a MemoryResource, the counterpart of
+// std::pmr::polymorphic_allocator.
+template<typename T>
+class ResourceAllocator
+{
+public:
+    using value_type = T;
+
+    ResourceAllocator(MemoryResource *resource = new_delete_resource()) noexcept
+        : resource_(resource)
+    {}
+    template<typename U>
+    ResourceAllocator(const ResourceAllocator<U> &other) noexcept
+        : resource_(other.resource())
+    {}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(resource_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, size_t n) { resource_->deallocate(p, n * sizeof(T), alignof(T)); }
+
+    MemoryResource *resource() const noexcept { return resource_; }
+
+private:
+    MemoryResource *resource_;
+};
+
+template<typename T, typename U>
+bool operator==(const ResourceAllocator<T> &a, const ResourceAllocator<U> &b) noexcept
+{
+    return a.resource() == b.resource() || a.resource()->is_equal(*b.resource());
+}
+
+template<typename T, typename U>
+bool operator!=(const ResourceAllocator<T> &a, const ResourceAllocator<U> &b) noexcept
+{
+    return !(a == b);
+}
+
+class JsonDocument;
+
+// Handle to a value stored inside a JsonDocument. It is just a document pointer
+// and an index, so copying it never touches a reference count. A handle stays
+// valid as long as its document is alive and has not been re-parsed.
+class JsonValue
+{
+public:
+    JsonValue() = default;
+
+    bool valid() const { return doc_ != nullptr; }
+    explicit operator bool() const { return valid(); }
+
+    JsonType get_type() const;
+    bool get_bool() const;
+    double get_double() const;
+    std::string get_string() const;
+    // Points into the document; not null-terminated.
+    const char *string_data() const;
+    size_t string_size() const;
+
+    // Number of elements of an array or members of an object.
+    size_t size() const;
+    JsonValue at(size_t index) const;
+    // Returns an invalid handle if `key` is not a member; every accessor of an
+    // invalid handle throws.
+    JsonValue find(const std::string &key) const;
+    std::string key(size_t member) const;
+    JsonValue value(size_t member) const;
+
+    // Deep copies the value into a shared-ownership tree that may be handed to
+    // other threads.
+    std::shared_ptr<JsonNode> to_node() const;
+    // Same layout as JsonNode::write; object members keep document order.
+    void write(std::ostream &out, int idt = 0) const;
+
+private:
+    friend class JsonDocument;
+
+    JsonValue(const JsonDocument *doc, uint32_t index)
+        : doc_(doc)
+        , index_(index)
+    {}
+
+    const JsonDocument *doc_ = nullptr;
+    uint32_t index_ = 0;
+};
+
+// Single-owner document: every value lives in flat vectors owned by the
+// document and children refer to each other by index, so there is one
+// allocation per vector instead of one shared_ptr per node. Meant for documents
+// that stay on the thread that parsed them; use JsonValue::to_node() (or
+// parse_json) when a document has to be shared.
+// All memory of the document comes from the MemoryResource given on
+// construction, which must outlive the document.
+class JsonDocument
+{
+public:
+    explicit JsonDocument(MemoryResource *resource = new_delete_resource())
+        : nodes_(ResourceAllocator<Node>(resource))
+        , links_(ResourceAllocator<uint32_t>(resource))
+        , chars_(ResourceAllocator<char>(resource))
+        , stack_(ResourceAllocator<uint32_t>(resource))
+    {
+        clear();
+    }
+
+    // Replaces the content with the value read from `in`. Memory from the
+    // previous document is reused.
+    void parse(std::istream &in)
+    {
+        nodes_.clear();
+        links_.clear();
+        chars_.clear();
+        stack_.clear();
+        detail::Scanner sc(in);
+        try {
+            if (sc.peek() == EOF)
+                add_node(JsonType::kNull);
+            else
+                parse_value(sc);
+        } catch (...) {
+            // leave a usable (null) document behind
+            stack_.clear();
+            clear();
+            throw;
+        }
+    }
+
+    void clear()
+    {
+        nodes_.clear();
+        links_.clear();
+        chars_.clear();
+        add_node(JsonType::kNull);
+    }
+
+    JsonValue root() const { return JsonValue(this, 0); }
+    size_t node_count() const { return nodes_.size(); }
+
+    void reserve(size_t nodes, size_t chars)
+    {
+        nodes_.reserve(nodes);
+        links_.reserve(nodes);
+        stack_.reserve(nodes);
+        chars_.reserve(chars);
+    }
+    MemoryResource *resource() const { return nodes_.get_allocator().resource(); }
+
+private:
+    friend class JsonValue;
+
+    struct Node
+    {
+        double number;
+        // string: range in chars_; array: `size` node indices starting at
+        // links_[begin]; object: `size` (key offset, key size, value) triples.
+        uint32_t begin;
+        uint32_t size;
+        JsonType type;
+        bool boolean;
+    };
+
+    template<typename T>
+    using Vector = std::vector<T, ResourceAllocator<T>>;
+    using String = std::basic_string<char, std::char_traits<char>, ResourceAllocator<char>>;
+
+    Vector<Node> nodes_;
+    Vector<uint32_t> links_;
+    String chars_;
+    Vector<uint32_t> stack_; // links of the containers being parsed
+
+    static uint32_t checked(size_t n)
+    {
+        if (n > UINT32_MAX)
+            throw std::runtime_error("Document is too large");
+        return static_cast<uint32_t>(n);
+    }
+
+    uint32_t add_node(JsonType type)
+    {
+        Node n;
+        n.number = 0;
+        n.begin = 0;
+        n.size = 0;
+        n.type = type;
+        n.boolean = false;
+        nodes_.push_back(n);
+        return checked(nodes_.size() - 1);
+    }
+
+    void read_string(detail::Scanner &sc, uint32_t &begin, uint32_t &size)
+    {
+        size_t start = chars_.size();
+        sc.read_string(chars_);
+        begin = checked(start);
+        size = checked(chars_.size() - start);
+    }
+
+    // Moves the links collected on stack_ since `mark` to links_.
+    void close_container(uint32_t idx, size_t mark, size_t stride)
+    {
+        nodes_[idx].begin = checked(links_.size());
+        nodes_[idx].size = checked((stack_.size() - mark) / stride);
+        links_.insert(links_.end(), stack_.begin() + mark, stack_.end());
+        stack_.resize(mark);
+    }
+
+    uint32_t parse_value(detail::Scanner &sc)
+    {
+        int letter = sc.peek();
+        switch (letter) {
+        case '"': {
+            sc.bump();
+            uint32_t idx = add_node(JsonType::kString);
+            uint32_t begin, size;
+            read_string(sc, begin, size);
+            nodes_[idx].begin = begin;
+            nodes_[idx].size = size;
+            return idx;
+        }
+        case 't':
+        case 'f': {
+            sc.read_literal(letter == 't' ? "true" : "false");
+            uint32_t idx = add_node(JsonType::kBool);
+            nodes_[idx].boolean = letter == 't';
+            return idx;
+        }
+        case 'n':
+            sc.read_literal("null");
+            return add_node(JsonType::kNull);
+        case '[': {
+            sc.bump();
+            uint32_t idx = add_node(JsonType::kArray);
+            size_t mark = stack_.size();
+            if (sc.peek() == ']') {
+                sc.bump();
+            } else {
+                for (;;) {
+                    uint32_t child = parse_value(sc);
+                    stack_.push_back(child);
+                    letter = sc.peek();
+                    sc.bump();
+                    if (letter == ']')
+                        break;
+                    if (letter != ',')
+                        throw detail::unexpected_char(letter);
+                }
+            }
+            close_container(idx, mark, 1);
+            return idx;
+        }
+        case '{': {
+            sc.bump();
+            uint32_t idx = add_node(JsonType::kObject);
+            size_t mark = stack_.size();
+            if (sc.peek() == '}') {
+                sc.bump();
+            } else {
+                for (;;) {
+                    sc.expect('"', "When Parsing object a key is expected");
+                    uint32_t begin, size;
+                    read_string(sc, begin, size);
+                    sc.expect(':', "When Parsing object an ':' missed");
+                    uint32_t child = parse_value(sc);
+                    stack_.push_back(begin);
+                    stack_.push_back(size);
+                    stack_.push_back(child);
+                    letter = sc.peek();
+                    sc.bump();
+                    if (letter == '}')
+                        break;
+                    if (letter != ',')
+                        throw detail::unexpected_char(letter);
+                }
+            }
+            close_container(idx, mark, 3);
+            return idx;
+        }
+        default:
+            if (letter == '-' || (letter >= '0' && letter <= '9')) {
+                double number = sc.read_number();
+                uint32_t idx = add_node(JsonType::kNumber);
+                nodes_[idx].number = number;
+                return idx;
+            }
+            throw detail::unexpected_char(letter);
+        }
+    }
+};
+
+inline JsonDocument parse_document(std::istream &in,
+                                   MemoryResource *resource = new_delete_resource())
+{
+    JsonDocument doc(resource);
+    doc.parse(in);
+    return doc;
+}
+
+inline JsonType JsonValue::get_type() const
+{
+    if (!valid())
+        throw std::runtime_error("It's an invalid JsonValue");
+    return doc_->nodes_[index_].type;
+}
+
+inline bool JsonValue::get_bool() const
+{
+    if (get_type() != JsonType::kBool)
+        throw std::runtime_error("It's not a bool");
+    return doc_->nodes_[index_].boolean;
+}
+
+inline double JsonValue::get_double() const
+{
+    if (get_type() != JsonType::kNumber)
+        throw std::runtime_error("It's not a number");
+    return doc_->nodes_[index_].number;
+}
+
+inline const char *JsonValue::string_data() const
+{
+    if (get_type() != JsonType::kString)
+        throw std::runtime_error("It's not a string");
+    return doc_->chars_.data() + doc_->nodes_[index_].begin;
+}
+
+inline size_t JsonValue::string_size() const
+{
+    if (get_type() != JsonType::kString)
+        throw std::runtime_error("It's not a string");
+    return doc_->nodes_[index_].size;
+}
+
+inline std::string JsonValue::get_string() const
+{
+    return std::string(string_data(), string_size());
+}
+
+inline size_t JsonValue::size() const
+{
+    JsonType type = get_type();
+    if (type != JsonType::kArray && type != JsonType::kObject)
+        throw std::runtime_error("It's not an array or object");
+    return doc_->nodes_[index_].size;
+}
+
+inline JsonValue JsonValue::at(size_t index) const
+{
+    if (get_type() != JsonType::kArray)
+        throw std::runtime_error("It's not an array");
+    auto &node = doc_->nodes_[index_];
+    if (index >= node.size)
+        throw std::out_of_range("JsonValue::at");
+    return JsonValue(doc_, doc_->links_[node.begin + index]);
+}
+
+inline std::string JsonValue::key(size_t member) const
+{
+    if (get_type() != JsonType::kObject)
+        throw std::runtime_error("It's not an object");
+    auto &node = doc_->nodes_[index_];
+    if (member >= node.size)
+        throw std::out_of_range("JsonValue::key");
+    const uint32_t *link = &doc_->links_[node.begin + 3 * member];
+    return std::string(doc_->chars_.data() + link[0], link[1]);
+}
+
+inline JsonValue JsonValue::value(size_t member) const
+{
+    if (get_type() != JsonType::kObject)
+        throw std::runtime_error("It's not an object");
+    auto &node = doc_->nodes_[index_];
+    if (member >= node.size)
+        throw std::out_of_range("JsonValue::value");
+    return JsonValue(doc_, doc_->links_[node.begin + 3 * member + 2]);
+}
+
+inline JsonValue JsonValue::find(const std::string &key) const
+{
+    if (get_type() != JsonType::kObject)
+        throw std::runtime_error("It's not an object");
+    auto &node = doc_->nodes_[index_];
+    // last occurrence wins, like the unordered_map in JsonObject
+    for (size_t i = node.size; i-- > 0;) {
+        const uint32_t *link = &doc_->links_[node.begin + 3 * i];
+        if (link[1] == key.size()
+            && key.compare(0, key.size(), doc_->chars_.data() + link[0], link[1]) == 0)
+            return JsonValue(doc_, link[2]);
+    }
+    return JsonValue();
+}
+
+inline std::shared_ptr<JsonNode> JsonValue::to_node() const
+{
+    switch (get_type()) {
+    case JsonType::kNull:
+        return std::make_shared<JsonNode>();
+    case JsonType::kBool:
+        return std::make_shared<JsonBool>(get_bool());
+    case JsonType::kNumber:
+        return std::make_shared<JsonDouble>(get_double());
+    case JsonType::kString:
+        return std::make_shared<JsonString>(get_string());
+    case JsonType::kArray: {
+        auto res = std::make_shared<JsonArray>();
+        auto &vec = res->get_array();
+        vec.reserve(size());
+        for (size_t i = 0, n = size(); i < n; ++i)
+            vec.push_back(at(i).to_node());
+        return std::move(res);
+    }
+    case JsonType::kObject: {
+        auto res = std::make_shared<JsonObject>();
+        auto &obj = res->get_object();
+        for (size_t i = 0, n = size(); i < n; ++i)
+            obj[key(i)] = value(i).to_node();
+        return std::move(res);
+    }
+    }
+    return std::make_shared<JsonNode>();
+}
+
+inline void JsonValue::write(std::ostream &out, int idt) const
+{
+    switch (get_type()) {
+    case JsonType::kNull:
+        out << "null";
+        break;
+    case JsonType::kBool:
+        out << (get_bool() ? "true" : "false");
+        break;
+    case JsonType::kNumber:
+        out << get_double();
+        break;
+    case JsonType::kString: {
+        std::string escaped;
+        detail::append_escaped(escaped, string_data(), string_size());
+        out << escaped;
+        break;
+    }
+    case JsonType::kArray:
+    case JsonType::kObject: {
+        bool is_object = get_type() == JsonType::kObject;
+        out << (is_object ? '{' : '[');
+        size_t n = size();
+        if (n == 0) {
+            out << (is_object ? '}' : ']');
+            break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (i != 0)
+                out << ',';
+            out << '\n';
+            detail::write_indent(out, idt);
+            if (is_object) {
+                detail::write_key(out, key(i));
+                value(i).write(out, idt + 1);
+            } else {
+                at(i).write(out, idt + 1);
+            }
+        }
+        out << '\n';
+        detail::write_indent(out, idt);
+        out << (is_object ? '}' : ']');
+        break;
+    }
+    }
+}
+
+enum class JsonToken : uint8_t {
+    kEnd = 0, // the top-level value has been fully read
+    kNull,
+    kBool,
+    kNumber,
+    kString,
+    kKey,
+    kBeginArray,
+    kEndArray,
+    kBeginObject,
+    kEndObject
+};
+
+// Pull parser: each next() reads one token from the stream, using the same
+// Scanner as parse_json. Memory use only depends on nesting depth, so huge
+// arrays can be walked element by element:
+//     JsonCursor cur(in);
+//     cur.next();                        // kBeginArray
+//     while (auto row = cur.read_node()) // one element at a time
+//         handle(row);
+//     cur.next();                        // kEndArray
+class JsonCursor
+{
+public:
+    explicit JsonCursor(std::istream &in)
+        : sc_(in)
+    {}
+
+    JsonToken next()
+    {
+        if (stack_.empty()) {
+            if (started_ || sc_.peek() == EOF)
+                return token_ = JsonToken::kEnd;
+            started_ = true;
+            return token_ = read_token();
+        }
+        Frame &f = stack_.back();
+        if (f.object && !f.after_key) {
+            if (close_if_end('}'))
+                return token_ = JsonToken::kEndObject;
+            read_key(f);
+            return token_ = JsonToken::kKey;
+        }
+        if (f.object) {
+            f.after_key = false;
+        } else {
+            if (close_if_end(']'))
+                return token_ = JsonToken::kEndArray;
+            separator(f);
+        }
+        return token_ = read_token();
+    }
+
+    JsonToken token() const { return token_; }
+    // Nesting depth of the current position; 0 outside the top-level value.
+    size_t depth() const { return stack_.size(); }
+
+    // Content of the current kString or kKey token. The reference points into
+    // the cursor's buffer and is overwritten by the next call.
+    const std::string &get_string_view() const
+    {
+        if (token_ != JsonToken::kString && token_ != JsonToken::kKey)
+            throw std::runtime_error("It's not a string");
+        return str_;
+    }
+    double get_number() const
+    {
+        if (token_ != JsonToken::kNumber)
+            throw std::runtime_error("It's not a number");
+        return number_;
+    }
+    bool get_bool() const
+    {
+        if (token_ != JsonToken::kBool)
+            throw std::runtime_error("It's not a bool");
+        return bool_;
+    }
+
+    // Skips the next value without decoding it. In an object the member key is
+    // still read and stays available through get_string_view(). Returns false,
+    // consuming nothing, when the current array/object has no more values.
+    bool skip_value()
+    {
+        if (!to_value())
+            return false;
+        sc_.skip_value();
+        return true;
+    }
+
+    // Parses the next value into a JsonNode tree, or returns nullptr, consuming
+    // nothing, when the current array/object has no more values.
+    std::shared_ptr<JsonNode> read_node()
+    {
+        if (!to_value())
+            return nullptr;
+        return detail::parse_node(sc_);
+    }
+
+private:
+    struct Frame
+    {
+        bool object;
+        bool after_key; // object: key read, value pending
+        size_t count;
+    };
+
+    detail::Scanner sc_;
+    std::vector<Frame> stack_;
+    std::string str_;
+    double number_ = 0;
+    bool bool_ = false;
+    bool started_ = false;
+    JsonToken token_ = JsonToken::kEnd;
+
+    bool close_if_end(char bracket)
+    {
+        if (sc_.peek() != bracket)
+            return false;
+        sc_.bump();
+        stack_.pop_back();
+        return true;
+    }
+
+    void separator(Frame &f)
+    {
+        if (f.count++ == 0)
+            return;
+        int c = sc_.peek();
+        if (c != ',')
+            throw detail::unexpected_char(c);
+        sc_.bump();
+    }
+
+    void read_key(Frame &f)
+    {
+        separator(f);
+        sc_.expect('"', "When Parsing object a key is expected");
+        str_.clear();
+        sc_.read_string(str_);
+        sc_.expect(':', "When Parsing object an ':' missed");
+        f.after_key = true;
+        token_ = JsonToken::kKey;
+    }
+
+    // Moves to the start of the next value, reading the member key if needed.
+    bool to_value()
+    {
+        if (stack_.empty()) {
+            if (started_ || sc_.peek() == EOF)
+                return false;
+            started_ = true;
+            return true;
+        }
+        Frame &f = stack_.back();
+        if (f.object) {
+            if (!f.after_key) {
+                if (sc_.peek() == '}')
+                    return false;
+                read_key(f);
+            }
+            f.after_key = false;
+            return true;
+        }
+        if (sc_.peek() == ']')
+            return false;
+        separator(f);
+        return true;
+    }
+
+    JsonToken read_token()
+    {
+        int letter = sc_.peek();
+        switch (letter) {
+        case '"':
+            sc_.bump();
+            str_.clear();
+            sc_.read_string(str_);
+            return JsonToken::kString;
+        case 't':
+        case 'f':
+            sc_.read_literal(letter == 't' ? "true" : "false");
+            bool_ = letter == 't';
+            return JsonToken::kBool;
+        case 'n':
+            sc_.read_literal("null");
+            return JsonToken::kNull;
+        case '[':
+        case '{': {
+            sc_.bump();
+            Frame f;
+            f.object = letter == '{';
+            f.after_key = false;
+            f.count = 0;
+            stack_.push_back(f);
+            return f.object ? JsonToken::kBeginObject : JsonToken::kBeginArray;
+        }
+        default:
+            if (letter == '-' || (letter >= '0' && letter <= '9')) {
+                number_ = sc_.read_number();
+                return JsonToken::kNumber;
+            }
+            throw detail::unexpected_char(letter);
+        }
+    }
+};
+
+// Streaming generator which emits compact JSON without building a JsonNode tree.
+// Output is collected in a buffer and handed to the sink whenever it grows past
+// `buffer_size`, so memory stays constant no matter how many values are written.
+// Debug builds (NDEBUG undefined) validate the call sequence and throw on misuse,
+// e.g. a key() outside of an object or an end_array() closing an object.
+class JsonWriter
+{
+public:
+    explicit JsonWriter(std::ostream &out, size_t buffer_size = 64 * 1024)
+        : out_(&out)
+        , buf_(&own_)
+        , buffer_size_(buffer_size)
+    {
+        own_.reserve(buffer_size_);
+    }
+
+    // Appends directly into `buffer`; nothing is flushed anywhere.
+    explicit JsonWriter(std::string &buffer)
+        : buf_(&buffer)
+        , buffer_size_(std::string::npos)
+    {}
+
+#if defined(PDJSON_HAS_FD)
+    explicit JsonWriter(int fd, size_t buffer_size = 64 * 1024)
+        : fd_(fd)
+        , buf_(&own_)
+        , buffer_size_(buffer_size)
+    {
+        own_.reserve(buffer_size_);
+    }
+#endif
+
+    JsonWriter(const JsonWriter &) = delete;
+    JsonWriter &operator=(const JsonWriter &) = delete;
+
+    ~JsonWriter()
+    {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    JsonWriter &begin_object()
+    {
+        before_value();
+        buf_->push_back('{');
+        open(kObject);
+        return *this;
+    }
+    JsonWriter &end_object()
+    {
+        close(kObject);
+        buf_->push_back('}');
+        after_value();
+        return *this;
+    }
+    JsonWriter &begin_array()
+    {
+        before_value();
+        buf_->push_back('[');
+        open(kArray);
+        return *this;
+    }
+    JsonWriter &end_array()
+    {
+        close(kArray);
+        buf_->push_back(']');
+        after_value();
+        return *this;
+    }
+
+    JsonWriter &key(const std::string &k)
+    {
+#if !defined(NDEBUG)
+        if (stack_.empty() || stack_.back() != kObject || expect_value_)
+            throw std::runtime_error("JsonWriter: key() is only allowed inside an object");
+        expect_value_ = true;
+#endif
+        if (need_comma_)
+            buf_->push_back(',');
+        detail::append_escaped(*buf_, k);
+        buf_->push_back(':');
+        need_comma_ = false;
+        return *this;
+    }
+
+    JsonWriter &value(const std::string &str)
+    {
+        before_value();
+        detail::append_escaped(*buf_, str);
+        after_value();
+        return *this;
+    }
+    JsonWriter &value(const char *str) { return value(std::string(str)); }
+    JsonWriter &value(bool b)
+    {
+        before_value();
+        b ? buf_->append("true", 4) : buf_->append("false", 5);
+        after_value();
+        return *this;
+    }
+    JsonWriter &value(double d)
+    {
+        before_value();
+        if (std::isfinite(d)) {
+            char tmp[32];
+            int n = std::snprintf(tmp, sizeof(tmp), "%.17g", d);
+            buf_->append(tmp, static_cast<size_t>(n));
+        } else {
+            buf_->append("null", 4); // JSON has no representation for inf/nan
+        }
+        after_value();
+        return *this;
+    }
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value,
+                            JsonWriter &>::type
+    value(T i)
+    {
+        before_value();
+        char tmp[32];
+        int n = std::is_signed<T>::value
+                    ? std::snprintf(tmp, sizeof(tmp), "%lld", static_cast<long long>(i))
+                    : std::snprintf(tmp, sizeof(tmp), "%llu", static_cast<unsigned long long>(i));
+        buf_->append(tmp, static_cast<size_t>(n));
+        after_value();
+        return *this;
+    }
+    JsonWriter &null_value()
+    {
+        before_value();
+        buf_->append("null", 4);
+        after_value();
+        return *this;
+    }
+
+    // Streams an existing subtree, so trees and generated values can be mixed.
+    JsonWriter &value(const JsonNode &node)
+    {
+        switch (node.get_type()) {
+        case JsonType::kNull:
+            return null_value();
+        case JsonType::kBool:
+            return value(node.get_bool());
+        case JsonType::kNumber:
+            return value(node.get_double());
+        case JsonType::kString:
+            return value(node.get_string());
+        case JsonType::kArray:
+            begin_array();
+            if (auto *numbers = dynamic_cast<const JsonNumberArray *>(&node)) {
+                if (!numbers->boxed()) {
+                    for (double d : numbers->get_numbers())
+                        value(d);
+                    return end_array();
+                }
+            }
+            for (auto &child : node.get_array())
+                value(*child);
+            return end_array();
+        case JsonType::kObject:
+            begin_object();
+            for (auto &kv : node.get_object()) {
+                key(kv.first);
+                value(*kv.second);
+            }
+            return end_object();
+        }
+        return *this;
+    }
+
+    // True once a single top-level value has been completely written.
+    bool complete() const { return depth_ == 0 && need_comma_; }
+
+    void flush()
+    {
+        if (buf_ != &own_ || own_.empty())
+            return;
+        if (out_) {
+            out_->write(own_.data(), static_cast<std::streamsize>(own_.size()));
+            out_->flush();
+            if (!out_->good())
+                throw std::runtime_error("JsonWriter: failed to write to stream");
+        }
+#if defined(PDJSON_HAS_FD)
+        else if (fd_ >= 0) {
+            const char *p = own_.data();
+            size_t left = own_.size();
+            while (left > 0) {
+                ssize_t n = ::write(fd_, p, left);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::runtime_error("JsonWriter: failed to write to fd");
+                }
+                p += n;
+                left -= static_cast<size_t>(n);
+            }
+        }
+#endif
+        own_.clear();
+    }
+
+private:
+    enum Scope : uint8_t { kArray, kObject };
+
+    std::ostream *out_ = nullptr;
+    int fd_ = -1;
+    std::string own_;
+    std::string *buf_;
+    size_t buffer_size_;
+    size_t depth_ = 0;
+    bool need_comma_ = false;
+#if !defined(NDEBUG)
+    std::vector<Scope> stack_;
+    bool expect_value_ = false;
+#endif
+
+    void before_value()
+    {
+#if !defined(NDEBUG)
+        if (stack_.empty()) {
+            if (need_comma_)
+                throw std::runtime_error("JsonWriter: only one top-level value may be written");
+        } else if (stack_.back() == kObject) {
+            if (!expect_value_)
+                throw std::runtime_error("JsonWriter: a value inside an object needs a key()");
+            expect_value_ = false;
+        }
+#endif
+        if (need_comma_)
+            buf_->push_back(',');
+    }
+    void after_value()
+    {
+        need_comma_ = true;
+        if (buf_->size() >= buffer_size_)
+            flush();
+    }
+    void open(Scope scope)
+    {
+#if !defined(NDEBUG)
+        stack_.push_back(scope);
+#else
+        (void) scope;
+#endif
+        ++depth_;
+        need_comma_ = false;
+    }
+    void close(Scope scope)
+    {
+#if !defined(NDEBUG)
+        if (stack_.empty() || stack_.back() != scope)
+            throw std::runtime_error("JsonWriter: mismatched end of array/object");
+        if (expect_value_)
+            throw std::runtime_error("JsonWriter: key() without a value");
+        stack_.pop_back();
+#else
+        (void) scope;
+#endif
+        --depth_;
+    }
+};
+
+struct ParallelWriteOptions
+{
+    // Worker threads; 0 means std::thread::hardware_concurrency().
+    unsigned threads = 0;
+    // Approximate number of nodes rendered by one task. Subtrees smaller than
+    // this are never split, so small documents are written sequentially.
+    size_t grain = 16 * 1024;
+    // How many finished-but-unwritten chunks may be buffered per worker.
+    size_t window_per_thread = 4;
+};
+
+NAMESPACE_BEGIN(detail)
+
+// Splits a tree into an ordered list of literal text and render tasks. A task
+// either writes a whole subtree (write_node) or a run of consecutive children
+// of one array/object (write_children), the layout JsonNode::write uses, so
+// concatenating literals and task output in order reproduces the sequential
+// writer byte for byte.
+class ParallelWritePlan
+{
+public:
+    struct Task
+    {
+        std::string prefix; // literal text emitted before this task's output
+        JsonNode *node;
+        int idt;
+        bool whole;         // write all of `node`, otherwise children [begin, end)
+        size_t begin, end;  // child positions in the node's iteration order
+    };
+
+    std::vector<Task> tasks;
+    std::string tail; // literal text after the last task
+
+    explicit ParallelWritePlan(size_t grain)
+        : grain_(grain)
+    {}
+
+    void plan(JsonNode &node, int idt)
+    {
+        // scalars, empty containers and small subtrees are written in one piece
+        JsonType type = node.get_type();
+        if ((type != JsonType::kArray && type != JsonType::kObject)
+            || weight(node, grain_) < grain_ || weight(node, 2) < 2) {
+            add_task(node, idt, true, 0, 0);
+            return;
+        }
+        if (auto *values = unboxed_values(node)) {
+            size_t size = values->size();
+            tail += '[';
+            for (size_t begin = 0; begin < size; begin += grain_)
+                add_task(node, idt, false, begin, std::min(size, begin + grain_));
+            close(idt, ']');
+        } else if (type == JsonType::kArray) {
+            auto &vec = static_cast<const JsonNode &>(node).get_array();
+            tail += '[';
+            split(node, idt, vec.begin(), vec.end(), [](std::ostream &, decltype(vec.begin())) {});
+            close(idt, ']');
+        } else {
+            auto &obj = static_cast<const JsonNode &>(node).get_object();
+            tail += '{';
+            split(node,
+                  idt,
+                  obj.begin(),
+                  obj.end(),
+                  [](std::ostream &out, decltype(obj.begin()) it) { write_key(out, it->first); });
+            close(idt, '}');
+        }
+    }
+
+    static void run(const Task &task, std::ostream &out)
+    {
+        if (task.whole)
+            write_node(*task.node, out, task.idt);
+        else
+            write_children(*task.node,
+                           out,
+                           task.idt,
+                           task.begin,
+                           task.end,
+                           [](const JsonNode &child, std::ostream &o, int i) {
+                               write_node(child, o, i);
+                           });
+    }
+
+private:
+    size_t grain_;
+
+    // Counts the nodes of a subtree, giving up once `limit` is reached.
+    static size_t weight(const JsonNode &node, size_t limit)
+    {
+        size_t n = 1;
+        if (auto *values = unboxed_values(node)) {
+            n += values->size();
+        } else if (node.get_type() == JsonType::kArray) {
+            for (auto &child : node.get_array()) {
+                if (n >= limit)
+                    break;
+                n += weight(*child, limit - n);
+            }
+        } else if (node.get_type() == JsonType::kObject) {
+            for (auto &kv : node.get_object()) {
+                if (n >= limit)
+                    break;
+                n += weight(*kv.second, limit - n);
+            }
+        }
+        return n;
+    }
+
+    static void separator(std::ostream &out, size_t k, int idt)
+    {
+        if (k != 0)
+            out << ',';
+        out << '\n';
+        write_indent(out, idt);
+    }
+
+    // Light children are batched into tasks of about `grain_` nodes, heavy
+    // children are planned recursively.
+    template<typename Iter, typename Key>
+    void split(JsonNode &node, int idt, Iter first, Iter last, Key key)
+    {
+        size_t k = 0, run_begin = 0, run_weight = 0;
+        for (Iter it = first; it != last; ++it, ++k) {
+            JsonNode &child = child_of(it);
+            size_t w = weight(child, grain_);
+            if (w >= grain_) {
+                if (run_begin < k)
+                    add_task(node, idt, false, run_begin, k);
+                std::ostringstream oss;
+                separator(oss, k, idt);
+                key(oss, it);
+                tail += oss.str();
+                plan(child, idt + 1);
+                run_begin = k + 1;
+                run_weight = 0;
+                continue;
+            }
+            run_weight += w;
+            if (run_weight >= grain_) {
+                add_task(node, idt, false, run_begin, k + 1);
+                run_begin = k + 1;
+                run_weight = 0;
+            }
+        }
+        if (run_begin < k)
+            add_task(node, idt, false, run_begin, k);
+    }
+
+    static JsonNode &child_of(std::vector<std::shared_ptr<JsonNode>>::const_iterator it)
+    {
+        return **it;
+    }
+    static JsonNode &child_of(
+        std::unordered_map<std::string, std::shared_ptr<JsonNode>>::const_iterator it)
+    {
+        return *it->second;
+    }
+
+    void close(int idt, char bracket)
+    {
+        std::ostringstream oss;
+        oss << '\n';
+        write_indent(oss, idt);
+        oss << bracket;
+        tail += oss.str();
+    }
+
+    void add_task(JsonNode &node, int idt, bool whole, size_t begin, size_t end)
+    {
+        Task t;
+        t.prefix.swap(tail);
+        t.node = &node;
+        t.idt = idt;
+        t.whole = whole;
+        t.begin = begin;
+        t.end = end;
+        tasks.push_back(std::move(t));
+    }
+};
+
+NAMESPACE_END(detail)
+
+// Writes `root` exactly like root.write(out, idt), but renders large arrays and
+// objects on several threads. Chunks are rendered into per-task buffers and
+// written in document order as soon as they are ready, so at most
+// `threads * window_per_thread` chunks are held in memory at a time.
+// The tree must not be modified while it is being written.
+inline void write_parallel(JsonNode &root,
+                           std::ostream &out,
+                           int idt = 0,
+                           const ParallelWriteOptions &options = ParallelWriteOptions())
+{
+    detail::ParallelWritePlan plan(options.grain == 0 ? 1 : options.grain);
+    plan.plan(root, idt);
+    auto &tasks = plan.tasks;
+
+    unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    if (threads > tasks.size())
+        threads = static_cast<unsigned>(tasks.size());
+
+    if (threads <= 1) {
+        for (auto &t : tasks) {
+            out << t.prefix;
+            detail::ParallelWritePlan::run(t, out);
+        }
+        out << plan.tail;
+        return;
+    }
+
+    const size_t window = threads * (options.window_per_thread ? options.window_per_thread : 1);
+    std::vector<std::string> results(tasks.size());
+    std::vector<char> done(tasks.size(), 0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next = 0, written = 0;
+    std::exception_ptr error;
+
+    auto worker = [&]() {
+        std::ostringstream oss;
+        oss.flags(out.flags());
+        oss.precision(out.precision());
+        oss.imbue(out.getloc());
+        for (;;) {
+            size_t idx;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] {
+                    return error || next >= tasks.size() || next < written + window;
+                });
+                if (error || next >= tasks.size())
+                    return;
+                idx = next++;
+            }
+            std::string rendered;
+            try {
+                oss.str(std::string());
+                detail::ParallelWritePlan::run(tasks[idx], oss);
+                rendered = oss.str();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+                cv.notify_all();
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            results[idx].swap(rendered);
+            done[idx] = 1;
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i)
+        pool.emplace_back(worker);
+
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        std::string chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return error || done[i]; });
+            if (error)
+                break;
+            chunk.swap(results[i]);
+            written = i + 1;
+        }
+        cv.notify_all();
+        out << tasks[i].prefix;
+        out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    }
+
+    for (auto &t : pool)
+        t.join();
+    if (error)
+        std::rethrow_exception(error);
+    out << plan.tail;
+}
+
+enum class Compression : uint8_t { kAuto, kNone, kGzip, kZstd };
+
+struct DecompressOptions
+{
+    // kAuto sniffs the first bytes: gzip and zstd magic numbers are recognised,
+    // anything else is read as plain JSON. kGzip also reads zlib streams.
+    Compression compression = Compression::kAuto;
+    // Decompress on a separate thread, a few blocks ahead of the parser.
+    bool background_thread = false;
+    size_t block_size = 64 * 1024;
+    // Decompressed blocks buffered ahead of the parser in background mode.
+    size_t queued_blocks = 4;
+};
+
+NAMESPACE_BEGIN(detail)
+
+// Read-only streambuf over memory the caller keeps alive; nothing is copied.
+class MemoryStreambuf : public std::streambuf
+{
+public:
+    MemoryStreambuf(const char *data, size_t size)
+    {
+        char *p = const_cast<char *>(data);
+        setg(p, p, p + size);
+    }
+};
+
+// Produces decompressed bytes block by block.
+class BlockSource
+{
+public:
+    virtual ~BlockSource() = default;
+    // Fills at most `size` bytes of `dst`; returns 0 once the input is exhausted.
+    virtual size_t read(char *dst, size_t size) = 0;
+};
+
+// Compressed input: the bytes consumed while sniffing the format come first,
+// then the rest of the stream.
+class RawInput
+{
+public:
+    RawInput(std::istream &in, std::string head, size_t block_size)
+        : in_(in)
+        , buf_(std::move(head))
+        , block_size_(block_size)
+    {}
+
+    // Returns the buffered bytes, refilling from the stream when empty.
+    bool fill(const char *&data, size_t &size)
+    {
+        if (pos_ == buf_.size()) {
+            buf_.resize(block_size_);
+            in_.read(&buf_[0], static_cast<std::streamsize>(block_size_));
+            buf_.resize(static_cast<size_t>(in_.gcount()));
+            pos_ = 0;
+        }
+        data = buf_.data() + pos_;
+        size = buf_.size() - pos_;
+        return size != 0;
+    }
+    void consume(size_t n) { pos_ += n; }
+    bool exhausted()
+    {
+        const char *data;
+        size_t size;
+        return !fill(data, size);
+    }
+
+private:
+    std::istream &in_;
+    std::string buf_;
+    size_t pos_ = 0;
+    size_t block_size_;
+};
+
+class PlainSource : public BlockSource
+{
+public:
+    explicit PlainSource(RawInput input)
+        : input_(std::move(input))
+    {}
+
+    size_t read(char *dst, size_t size) override
+    {
+        const char *data;
+        size_t avail;
+        if (!input_.fill(data, avail))
+            return 0;
+        size_t n = std::min(size, avail);
+        std::copy(data, data + n, dst);
+        input_.consume(n);
+        return n;
+    }
+
+private:
+    RawInput input_;
+};
+
+#if defined(PDJSON_HAS_ZLIB)
+// gzip or zlib stream; concatenated gzip members are decoded one after another.
+class GzipSource : public BlockSource
+{
+public:
+    explicit GzipSource(RawInput input)
+        : input_(std::move(input))
+    {
+        zs_ = z_stream();
+        if (inflateInit2(&zs_, 15 + 32) != Z_OK) // +32: detect gzip or zlib header
+            throw std::runtime_error("inflateInit2 failed");
+    }
+    ~GzipSource() { inflateEnd(&zs_); }
+
+    size_t read(char *dst, size_t size) override
+    {
+        zs_.next_out = reinterpret_cast<Bytef *>(dst);
+        zs_.avail_out = static_cast<uInt>(std::min<size_t>(size, UINT32_MAX));
+        while (!finished_ && zs_.avail_out == size) {
+            const char *data;
+            size_t avail;
+            if (!input_.fill(data, avail))
+                throw std::runtime_error("Truncated gzip input");
+            zs_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+            zs_.avail_in = static_cast<uInt>(std::min<size_t>(avail, UINT32_MAX));
+            int ret = inflate(&zs_, Z_NO_FLUSH);
+            input_.consume(avail - zs_.avail_in);
+            if (ret == Z_STREAM_END) {
+                if (input_.exhausted())
+                    finished_ = true;
+                else
+                    inflateReset(&zs_);
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw std::runtime_error(std::string("gzip: ")
+                                         + (zs_.msg ? zs_.msg : "inflate failed"));
+            }
+        }
+        return size - zs_.avail_out;
+    }
+
+private:
+    RawInput input_;
+    z_stream zs_;
+    bool finished_ = false;
+};
+#endif
+
+#if defined(PDJSON_HAS_ZSTD)
+class ZstdSource : public BlockSource
+{
+public:
+    explicit ZstdSource(RawInput input)
+        : input_(std::move(input))
+        , ctx_(ZSTD_createDCtx())
+    {
+        if (!ctx_)
+            throw std::runtime_error("ZSTD_createDCtx failed");
+    }
+    ~ZstdSource() { ZSTD_freeDCtx(ctx_); }
+
+    size_t read(char *dst, size_t size) override
+    {
+        ZSTD_outBuffer out = {dst, size, 0};
+        while (out.pos == 0) {
+            const char *data;
+            size_t avail;
+            if (!input_.fill(data, avail)) {
+                if (pending_)
+                    throw std::runtime_error("Truncated zstd input");
+                return 0;
+            }
+            ZSTD_inBuffer in = {data, avail, 0};
+            size_t ret = ZSTD_decompressStream(ctx_, &out, &in);
+            input_.consume(in.pos);
+            if (ZSTD_isError(ret))
+                throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+            pending_ = ret != 0;
+        }
+        return out.pos;
+    }
+
+private:
+    RawInput input_;
+    ZSTD_DCtx *ctx_;
+    bool pending_ = false;
+};
+#endif
+
+inline std::unique_ptr<BlockSource> make_source(std::istream &in, const DecompressOptions &options)
+{
+    // sniff the magic number
+    std::string head;
+    Compression kind = options.compression;
+    if (kind == Compression::kAuto) {
+        head.resize(4);
+        in.read(&head[0], 4);
+        head.resize(static_cast<size_t>(in.gcount()));
+        auto byte = [&head](size_t i) { return static_cast<unsigned char>(head[i]); };
+        kind = Compression::kNone;
+        // zlib streams have no real magic number (plain "80" passes the header
+        // check), so they are only read with an explicit kGzip
+        if (head.size() >= 2 && byte(0) == 0x1f && byte(1) == 0x8b)
+            kind = Compression::kGzip;
+        else if (head.size() >= 4 && byte(0) == 0x28 && byte(1) == 0xb5 && byte(2) == 0x2f
+                 && byte(3) == 0xfd)
+            kind = Compression::kZstd;
+    }
+    RawInput input(in, std::move(head), options.block_size ? options.block_size : 64 * 1024);
+    switch (kind) {
+    case Compression::kGzip:
+#if defined(PDJSON_HAS_ZLIB)
+        return std::unique_ptr<BlockSource>(new GzipSource(std::move(input)));
+#else
+        throw std::runtime_error("gzip input, but pdjson was built without zlib");
+#endif
+    case Compression::kZstd:
+#if defined(PDJSON_HAS_ZSTD)
+        return std::unique_ptr<BlockSource>(new ZstdSource(std::move(input)));
+#else
+        throw std::runtime_error("zstd input, but pdjson was built without zstd");
+#endif
+    default:
+        return std::unique_ptr<BlockSource>(new PlainSource(std::move(input)));
+    }
+}
+
+// Decompresses one block whenever the parser runs out of data.
+class DecompressStreambuf : public std::streambuf
+{
+public:
+    DecompressStreambuf(std::unique_ptr<BlockSource> source, size_t block_size)
+        : source_(std::move(source))
+        , buf_(block_size)
+    {}
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        size_t n = source_->read(buf_.data(), buf_.size());
+        if (n == 0)
+            return traits_type::eof();
+        setg(buf_.data(), buf_.data(), buf_.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    std::unique_ptr<BlockSource> source_;
+    std::vector<char> buf_;
+};
+
+// Decompresses on a worker thread into a bounded queue of blocks, so
+// decompression and parsing overlap.
+class PipelinedStreambuf : public std::streambuf
+{
+public:
+    PipelinedStreambuf(std::unique_ptr<BlockSource> source, size_t block_size, size_t queued)
+        : source_(std::move(source))
+        , block_size_(block_size)
+        , queued_(queued ? queued : 1)
+    {
+        worker_ = std::thread([this] { produce(); });
+    }
+    ~PipelinedStreambuf()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        worker_.join();
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!current_.empty())
+            spare_.push_back(std::move(current_));
+        cv_.notify_all();
+        cv_.wait(lock, [this] { return !ready_.empty() || done_; });
+        if (ready_.empty()) {
+            if (error_)
+                std::rethrow_exception(error_);
+            return traits_type::eof();
+        }
+        current_ = std::move(ready_.front());
+        ready_.erase(ready_.begin());
+        cv_.notify_all();
+        lock.unlock();
+        char *p = &current_[0];
+        setg(p, p, p + current_.size());
+        return traits_type::to_int_type(*p);
+    }
+
+private:
+    std::unique_ptr<BlockSource> source_;
+    size_t block_size_;
+    size_t queued_;
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::string> ready_;
+    std::vector<std::string> spare_; // consumed blocks kept for reuse
+    std::string current_;
+    std::exception_ptr error_;
+    bool done_ = false;
+    bool stop_ = false;
+
+    void produce()
+    {
+        try {
+            for (;;) {
+                std::string block;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cv_.wait(lock, [this] { return stop_ || ready_.size() < queued_; });
+                    if (stop_)
+                        break;
+                    if (!spare_.empty()) {
+                        block = std::move(spare_.back());
+                        spare_.pop_back();
+                    }
+                }
+                block.resize(block_size_);
+                size_t n = source_->read(&block[0], block.size());
+                if (n == 0)
+                    break;
+                block.resize(n);
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_.push_back(std::move(block));
+                cv_.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        cv_.notify_all();
+    }
+};
+
+struct StreambufHolder
+{
+    std::unique_ptr<std::streambuf> streambuf_;
+};
+
+NAMESPACE_END(detail)
+
+// Input stream yielding the decompressed content of `in`, one block at a time,
+// so the whole document is never materialised. Works with every parser here:
+//     pd::DecompressingStream z(file);
+//     auto doc = pd::parse_document(z);
+class DecompressingStream : private detail::StreambufHolder, public std::istream
+{
+public:
+    explicit DecompressingStream(std::istream &in,
+                                 const DecompressOptions &options = DecompressOptions())
+        : std::istream(nullptr)
+    {
+        size_t block_size = options.block_size ? options.block_size : 64 * 1024;
+        auto source = detail::make_source(in, options);
+        if (options.background_thread)
+            streambuf_.reset(new detail::PipelinedStreambuf(std::move(source),
+                                                            block_size,
+                                                            options.queued_blocks));
+        else
+            streambuf_.reset(new detail::DecompressStreambuf(std::move(source), block_size));
+        rdbuf(streambuf_.get());
+    }
+};
+
+inline std::shared_ptr<JsonNode> parse_json_compressed(
+    std::istream &in, const DecompressOptions &options = DecompressOptions())
+{
+    DecompressingStream z(in, options);
+    return parse_json(z);
+}
+
+inline std::shared_ptr<JsonNode> parse_json_compressed(
+    const char *data, size_t size, const DecompressOptions &options = DecompressOptions())
+{
+    detail::MemoryStreambuf buf(data, size);
+    std::istream in(&buf);
+    return parse_json_compressed(in, options);
+}
+
+// Parses a plain, gzip or zstd compressed file.
+inline std::shared_ptr<JsonNode> parse_json_file(
+    const std::string &filename, const DecompressOptions &options = DecompressOptions())
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good())
+        throw(std::runtime_error("Can not open" + filename));
+    return parse_json_compressed(in, options);
+}
+
+// Parser for many small documents in a row. The document it fills, including
+// its node/string buffers and the parse stack, belongs to the Parser and is
+// cleared rather than freed between calls. Those buffers act as the arena:
+// once they have grown to fit the largest document seen, parsing does not
+// touch the heap any more.
+class Parser
+{
+public:
+    explicit Parser(MemoryResource *resource = new_delete_resource())
+        : doc_(resource)
+    {}
+
+    // The returned document is overwritten by the next parse.
+    const JsonDocument &parse(std::istream &in)
+    {
+        doc_.parse(in);
+        return doc_;
+    }
+    const JsonDocument &parse(const char *data, size_t size)
+    {
+        detail::MemoryStreambuf buf(data, size);
+        std::istream in(&buf);
+        return parse(in);
+    }
+    const JsonDocument &parse(const std::string &text) { return parse(text.data(), text.size()); }
+
+    // Calls on_document(index, document) for every string in [first, last).
+    // Parse errors propagate and stop the batch.
+    template<typename Iter, typename OnDocument>
+    void parse_batch(Iter first, Iter last, OnDocument on_document)
+    {
+        for (size_t i = 0; first != last; ++first, ++i)
+            on_document(i, parse(first->data(), first->size()));
+    }
+
+    // Like above, but a document that fails to parse is reported through
+    // on_error(index, exception) and the batch goes on.
+    template<typename Iter, typename OnDocument, typename OnError>
+    void parse_batch(Iter first, Iter last, OnDocument on_document, OnError on_error)
+    {
+        for (size_t i = 0; first != last; ++first, ++i) {
+            try {
+                parse(first->data(), first->size());
+            } catch (const std::exception &e) {
+                on_error(i, e);
+                continue;
+            }
+            on_document(i, static_cast<const JsonDocument &>(doc_));
+        }
+    }
+
+    // Pre-sizes the buffers so even the first documents parse without growing.
+    void reserve(size_t nodes, size_t chars) { doc_.reserve(nodes, chars); }
+
+private:
+    JsonDocument doc_;
+};
+
+// Fast non-cryptographic 64-bit hash of raw input bytes, e.g. to recognise a
+// payload that was seen before without parsing it.
+inline uint64_t content_hash(const char *data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
+    uint64_t h = seed ^ (size * m);
+    auto mix = [](uint64_t h, uint64_t v) {
+        v *= 0xbf58476d1ce4e5b9ull;
+        v ^= v >> 31;
+        h ^= v;
+        h = (h << 27) | (h >> 37);
+        return h * 0x94d049bb133111ebull + 0x52dce729;
+    };
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, data + i, 8);
+        h = mix(h, v);
+    }
+    if (i < size) {
+        uint64_t v = 0;
+        std::memcpy(&v, data + i, size - i);
+        h = mix(h, v ^ m);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+inline uint64_t content_hash(const std::string &text, uint64_t seed = 0)
+{
+    return content_hash(text.data(), text.size(), seed);
+}
+
+NAMESPACE_BEGIN(detail)
+
+inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    h ^= h >> 29;
+    return h * 0xbf58476d1ce4e5b9ull;
+}
+
+inline uint64_t hash_number(double value)
+{
+    if (value == 0)
+        value = 0; // -0 == 0
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return hash_mix(static_cast<uint64_t>(JsonType::kNumber), bits);
+}
+
+// Rough heap footprint of a tree, used for cache budgets.
+inline size_t approximate_size(const JsonNode &node)
+{
+    switch (node.get_type()) {
+    case JsonType::kString:
+        return sizeof(JsonString) + 32 + node.get_string().capacity();
+    case JsonType::kArray: {
+        if (auto *values = unboxed_values(node))
+            return sizeof(JsonNumberArray) + 32 + values->capacity() * sizeof(double);
+        size_t size = sizeof(JsonArray) + 32;
+        for (auto &child : node.get_array())
+            size += sizeof(child) + approximate_size(*child);
+        return size;
+    }
+    case JsonType::kObject: {
+        size_t size = sizeof(JsonObject) + 32;
+        for (auto &kv : node.get_object())
+            size += 64 + kv.first.capacity() + approximate_size(*kv.second);
+        return size;
+    }
+    default:
+        return sizeof(JsonDouble) + 32;
+    }
+}
+
+NAMESPACE_END(detail)
+
+// Hash of the value a tree represents: the order of object members, the way
+// numbers were written and the whitespace of the input do not matter, so
+// structurally equal trees hash equally (see structural_equal).
+inline uint64_t structural_hash(const JsonNode &node)
+{
+    JsonType type = node.get_type();
+    uint64_t h = static_cast<uint64_t>(type);
+    switch (type) {
+    case JsonType::kNull:
+        return detail::hash_mix(h, 0);
+    case JsonType::kBool:
+        return detail::hash_mix(h, node.get_bool() ? 1 : 2);
+    case JsonType::kNumber:
+        return detail::hash_number(node.get_double());
+    case JsonType::kString: {
+        auto &str = node.get_string();
+        return detail::hash_mix(h, content_hash(str.data(), str.size()));
+    }
+    case JsonType::kArray:
+        if (auto *values = detail::unboxed_values(node)) {
+            for (double v : *values)
+                h = detail::hash_mix(h, detail::hash_number(v));
+            return detail::hash_mix(h, values->size());
+        }
+        for (auto &child : node.get_array())
+            h = detail::hash_mix(h, structural_hash(*child));
+        return detail::hash_mix(h, node.get_array().size());
+    case JsonType::kObject: {
+        // members are combined with a sum, which does not depend on their order
+        uint64_t sum = 0;
+        for (auto &kv : node.get_object())
+            sum += detail::hash_mix(content_hash(kv.first), structural_hash(*kv.second));
+        return detail::hash_mix(detail::hash_mix(h, sum), node.get_object().size());
+    }
+    }
+    return h;
+}
+
+// Deep comparison of the values two trees represent, ignoring member order.
+inline bool structural_equal(const JsonNode &a, const JsonNode &b)
+{
+    if (&a == &b)
+        return true;
+    if (a.get_type() != b.get_type())
+        return false;
+    switch (a.get_type()) {
+    case JsonType::kNull:
+        return true;
+    case JsonType::kBool:
+        return a.get_bool() == b.get_bool();
+    case JsonType::kNumber:
+        return a.get_double() == b.get_double();
+    case JsonType::kString:
+        return a.get_string() == b.get_string();
+    case JsonType::kArray: {
+        auto *va = detail::unboxed_values(a);
+        auto *vb = detail::unboxed_values(b);
+        if (va && vb)
+            return *va == *vb;
+        size_t size = va ? va->size() : a.get_array().size();
+        if (size != (vb ? vb->size() : b.get_array().size()))
+            return false;
+        for (size_t i = 0; i < size; ++i) {
+            if (va) {
+                const JsonNode &child = *b.get_array()[i];
+                if (child.get_type() != JsonType::kNumber || child.get_double() != (*va)[i])
+                    return false;
+            } else if (vb) {
+                const JsonNode &child = *a.get_array()[i];
+                if (child.get_type() != JsonType::kNumber || child.get_double() != (*vb)[i])
+                    return false;
+            } else if (!structural_equal(*a.get_array()[i], *b.get_array()[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case JsonType::kObject: {
+        auto &oa = a.get_object();
+        auto &ob = b.get_object();
+        if (oa.size() != ob.size())
+            return false;
+        for (auto &kv : oa) {
+            auto it = ob.find(kv.first);
+            if (it == ob.end() || !structural_equal(*kv.second, *it->second))
+                return false;
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+// LRU cache of parsed documents keyed by the content hash of their input, for
+// payloads that arrive again and again. Documents are shared and immutable;
+// a hit returns the same tree as the first parse. Entries are evicted, least
+// recently used first, once the inputs plus the estimated tree sizes exceed
+// the memory budget. Inputs are kept to rule out hash collisions. Safe to use
+// from several threads; parsing happens outside the lock.
+class ParseCache
+{
+public:
+    explicit ParseCache(size_t budget_bytes)
+        : budget_(budget_bytes)
+    {}
+
+    std::shared_ptr<const JsonNode> parse(const char *data, size_t size)
+    {
+        uint64_t hash = content_hash(data, size);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = index_.find(hash);
+            if (it != index_.end() && it->second->input.size() == size
+                && std::memcmp(it->second->input.data(), data, size) == 0) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                hits_++;
+                return it->second->root;
+            }
+            misses_++;
+        }
+
+        detail::MemoryStreambuf buf(data, size);
+        std::istream in(&buf);
+        std::shared_ptr<const JsonNode> root = parse_json(in);
+        size_t cost = size + detail::approximate_size(*root);
+        if (cost > budget_)
+            return root;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(hash);
+        if (it != index_.end())
+            drop(it->second); // parsed concurrently, or a collision
+        lru_.push_front(Entry{hash, std::string(data, size), root, cost});
+        index_[hash] = lru_.begin();
+        usage_ += cost;
+        while (usage_ > budget_)
+            drop(std::prev(lru_.end()));
+        return root;
+    }
+    std::shared_ptr<const JsonNode> parse(const std::string &text)
+    {
+        return parse(text.data(), text.size());
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        lru_.clear();
+        index_.clear();
+        usage_ = 0;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return lru_.size();
+    }
+    // Estimated bytes held by the cached entries.
+    size_t memory_usage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return usage_;
+    }
+    size_t hits() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_;
+    }
+    size_t misses() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return misses_;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        std::string input;
+        std::shared_ptr<const JsonNode> root;
+        size_t cost;
+    };
+
+    void drop(std::list<Entry>::iterator it)
+    {
+        usage_ -= it->cost;
+        index_.erase(it->hash);
+        lru_.erase(it);
     }
 
-    else if (letter == '{') {
-        auto res = std::make_shared<JsonObject>();
+    size_t budget_;
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    size_t usage_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
 
-        // key-value pair
-        do {
-            letter = trim_whitespace();
-            if (letter == ',') {
-                letter = trim_whitespace(); //move to next char which is not whitespace
-            }
-            if (letter == '"') {
-                std::string key = parse_string();
-                letter = trim_whitespace();
-                if (letter != ':') {
-                    throw std::runtime_error("When Parsing object an ':' missed");
-                }
-                res->get_object()[key] = parse_json(in);
+// Thrown when a document does not match a JsonSchema. path() is the JSON
+// pointer of the offending value ("" for the root).
+class SchemaError : public std::runtime_error
+{
+public:
+    SchemaError(const std::string &path, const std::string &message)
+        : std::runtime_error((path.empty() ? std::string("/") : path) + ": " + message)
+        , path_(path)
+    {}
+
+    const std::string &path() const { return path_; }
+
+private:
+    std::string path_;
+};
+
+// JSON Schema compiled for checking documents while they are parsed. Supports
+// type (including "integer" and lists of types), required, properties, items,
+// enum, minimum, maximum and maxLength; other keywords are ignored. validate()
+// reads the input through a JsonCursor and never builds a tree, members and
+// elements the schema says nothing about are skipped with a byte scan. parse()
+// builds the tree in the same pass. Both stop at the first violation with a
+// SchemaError.
+class JsonSchema
+{
+public:
+    explicit JsonSchema(const JsonNode &schema) { compile(schema); }
+    explicit JsonSchema(std::istream &schema) { compile(*parse_json(schema)); }
+
+    void validate(std::istream &in) const
+    {
+        JsonCursor cur(in);
+        std::string path;
+        check(0, first_token(cur), cur, path, false);
+    }
+
+    std::shared_ptr<JsonNode> parse(std::istream &in) const
+    {
+        JsonCursor cur(in);
+        std::string path;
+        return check(0, first_token(cur), cur, path, true);
+    }
+
+private:
+    enum : uint8_t {
+        kAllowNull = 1 << 0,
+        kAllowBool = 1 << 1,
+        kAllowNumber = 1 << 2,
+        kAllowInteger = 1 << 3,
+        kAllowString = 1 << 4,
+        kAllowArray = 1 << 5,
+        kAllowObject = 1 << 6,
+        kAllowAll = 0x7f
+    };
+
+    struct Member
+    {
+        int rule = -1;     // -1: anything goes
+        int required = -1; // index into Rule::required
+    };
 
+    struct Rule
+    {
+        uint8_t types = kAllowAll;
+        bool has_minimum = false;
+        bool has_maximum = false;
+        double minimum = 0;
+        double maximum = 0;
+        size_t max_length = SIZE_MAX;
+        int items = -1;
+        std::unordered_map<std::string, Member> members;
+        std::vector<std::string> required;
+        std::vector<std::shared_ptr<JsonNode>> enumeration;
+    };
+
+    std::vector<Rule> rules_;
+
+    static uint8_t type_bit(const std::string &name)
+    {
+        if (name == "null")
+            return kAllowNull;
+        if (name == "boolean")
+            return kAllowBool;
+        if (name == "number")
+            return kAllowNumber;
+        if (name == "integer")
+            return kAllowInteger;
+        if (name == "string")
+            return kAllowString;
+        if (name == "array")
+            return kAllowArray;
+        if (name == "object")
+            return kAllowObject;
+        throw std::runtime_error("Unknown schema type " + name);
+    }
+
+    int compile(const JsonNode &schema)
+    {
+        if (schema.get_type() == JsonType::kBool && schema.get_bool())
+            return add_rule();
+        if (schema.get_type() != JsonType::kObject)
+            throw std::runtime_error("A schema must be an object");
+        int index = add_rule();
+        auto &obj = schema.get_object();
+        auto get = [&obj](const char *keyword) -> const JsonNode * {
+            auto it = obj.find(keyword);
+            return it != obj.end() ? it->second.get() : nullptr;
+        };
+        if (const JsonNode *type = get("type")) {
+            uint8_t types = 0;
+            if (type->get_type() == JsonType::kArray) {
+                for (auto &name : type->get_array())
+                    types |= type_bit(static_cast<const JsonNode &>(*name).get_string());
             } else {
+                types = type_bit(type->get_string());
+            }
+            rules_[index].types = types;
+        }
+        if (const JsonNode *minimum = get("minimum")) {
+            rules_[index].has_minimum = true;
+            rules_[index].minimum = minimum->get_double();
+        }
+        if (const JsonNode *maximum = get("maximum")) {
+            rules_[index].has_maximum = true;
+            rules_[index].maximum = maximum->get_double();
+        }
+        if (const JsonNode *max_length = get("maxLength"))
+            rules_[index].max_length = static_cast<size_t>(max_length->get_double());
+        if (const JsonNode *enumeration = get("enum"))
+            rules_[index].enumeration = enumeration->get_array();
+        if (const JsonNode *items = get("items")) {
+            int rule = compile(*items);
+            rules_[index].items = rule;
+        }
+        if (const JsonNode *properties = get("properties")) {
+            for (auto &kv : properties->get_object()) {
+                int rule = compile(*kv.second);
+                rules_[index].members[kv.first].rule = rule;
+            }
+        }
+        if (const JsonNode *required = get("required")) {
+            Rule &rule = rules_[index];
+            for (auto &entry : required->get_array()) {
+                auto &name = static_cast<const JsonNode &>(*entry).get_string();
+                Member &member = rule.members[name];
+                if (member.required < 0) {
+                    member.required = static_cast<int>(rule.required.size());
+                    rule.required.push_back(name);
+                }
+            }
+        }
+        return index;
+    }
+
+    int add_rule()
+    {
+        rules_.emplace_back();
+        return static_cast<int>(rules_.size() - 1);
+    }
+
+    // An empty input is a null document, as for parse_json.
+    static JsonToken first_token(JsonCursor &cur)
+    {
+        JsonToken token = cur.next();
+        return token == JsonToken::kEnd ? JsonToken::kNull : token;
+    }
+
+    static size_t utf8_length(const std::string &str)
+    {
+        size_t n = 0;
+        for (char c : str)
+            n += (static_cast<unsigned char>(c) & 0xc0) != 0x80;
+        return n;
+    }
+
+    static const char *type_name(JsonToken token)
+    {
+        switch (token) {
+        case JsonToken::kNull:
+            return "null";
+        case JsonToken::kBool:
+            return "boolean";
+        case JsonToken::kNumber:
+            return "number";
+        case JsonToken::kString:
+            return "string";
+        case JsonToken::kBeginArray:
+            return "array";
+        default:
+            return "object";
+        }
+    }
+
+    static bool type_allowed(const Rule &rule, JsonToken token, double number)
+    {
+        switch (token) {
+        case JsonToken::kNull:
+            return rule.types & kAllowNull;
+        case JsonToken::kBool:
+            return rule.types & kAllowBool;
+        case JsonToken::kNumber:
+            return (rule.types & kAllowNumber)
+                   || ((rule.types & kAllowInteger) && std::floor(number) == number);
+        case JsonToken::kString:
+            return rule.types & kAllowString;
+        case JsonToken::kBeginArray:
+            return rule.types & kAllowArray;
+        default:
+            return rule.types & kAllowObject;
+        }
+    }
+
+    static bool scalar_in_enum(const Rule &rule, JsonToken token, const JsonCursor &cur)
+    {
+        for (auto &option : rule.enumeration) {
+            const JsonNode &value = *option;
+            switch (token) {
+            case JsonToken::kNull:
+                if (value.get_type() == JsonType::kNull)
+                    return true;
+                break;
+            case JsonToken::kBool:
+                if (value.get_type() == JsonType::kBool && value.get_bool() == cur.get_bool())
+                    return true;
+                break;
+            case JsonToken::kNumber:
+                if (value.get_type() == JsonType::kNumber && value.get_double() == cur.get_number())
+                    return true;
                 break;
+            default:
+                if (value.get_type() == JsonType::kString
+                    && value.get_string() == cur.get_string_view())
+                    return true;
+                break;
+            }
+        }
+        return false;
+    }
+
+    // Checks the value starting with `token` against rule `index` (-1: no
+    // constraints) and returns it as a tree when `build` is set.
+    std::shared_ptr<JsonNode> check(
+        int index, JsonToken token, JsonCursor &cur, std::string &path, bool build) const
+    {
+        if (index < 0)
+            return build ? plain(token, cur) : (skip(token, cur), nullptr);
+        const Rule &rule = rules_[index];
+        double number = token == JsonToken::kNumber ? cur.get_number() : 0;
+        if (!type_allowed(rule, token, number))
+            throw SchemaError(path, std::string("unexpected ") + type_name(token));
+
+        if (token == JsonToken::kBeginArray || token == JsonToken::kBeginObject) {
+            // enum on a container compares the whole value, so it is built
+            bool keep = build || !rule.enumeration.empty();
+            auto res = token == JsonToken::kBeginArray ? check_array(rule, cur, path, keep)
+                                                       : check_object(rule, cur, path, keep);
+            if (!rule.enumeration.empty()) {
+                bool found = false;
+                for (auto &option : rule.enumeration)
+                    found = found || structural_equal(*res, *option);
+                if (!found)
+                    throw SchemaError(path, "value is not one of the enum values");
+            }
+            return res;
+        }
+
+        if (token == JsonToken::kNumber) {
+            if (rule.has_minimum && number < rule.minimum)
+                throw SchemaError(path, "number is below the minimum");
+            if (rule.has_maximum && number > rule.maximum)
+                throw SchemaError(path, "number is above the maximum");
+        } else if (token == JsonToken::kString && rule.max_length != SIZE_MAX
+                   && utf8_length(cur.get_string_view()) > rule.max_length) {
+            throw SchemaError(path, "string is longer than maxLength");
+        }
+        if (!rule.enumeration.empty() && !scalar_in_enum(rule, token, cur))
+            throw SchemaError(path, "value is not one of the enum values");
+        return build ? plain(token, cur) : nullptr;
+    }
+
+    std::shared_ptr<JsonNode> check_array(const Rule &rule,
+                                          JsonCursor &cur,
+                                          std::string &path,
+                                          bool build) const
+    {
+        if (rule.items < 0 && !build) {
+            skip(JsonToken::kBeginArray, cur);
+            return nullptr;
+        }
+        std::shared_ptr<JsonArray> res = build ? std::make_shared<JsonArray>() : nullptr;
+        size_t length = path.size();
+        for (size_t i = 0;; ++i) {
+            JsonToken token = cur.next();
+            if (token == JsonToken::kEndArray)
+                break;
+            detail::append_pointer_token(path, std::to_string(i));
+            auto child = check(rule.items, token, cur, path, build);
+            path.resize(length);
+            if (build)
+                res->get_array().push_back(std::move(child));
+        }
+        return build ? numbers_if_possible(std::move(res)) : nullptr;
+    }
+
+    std::shared_ptr<JsonNode> check_object(const Rule &rule,
+                                           JsonCursor &cur,
+                                           std::string &path,
+                                           bool build) const
+    {
+        std::shared_ptr<JsonObject> res = build ? std::make_shared<JsonObject>() : nullptr;
+        std::vector<bool> seen(rule.required.size());
+        size_t length = path.size();
+        std::string key;
+        while (cur.next() == JsonToken::kKey) {
+            key = cur.get_string_view();
+            auto it = rule.members.find(key);
+            const Member *member = it != rule.members.end() ? &it->second : nullptr;
+            if (member && member->required >= 0)
+                seen[static_cast<size_t>(member->required)] = true;
+            if (!build && (!member || member->rule < 0)) {
+                cur.skip_value();
+                continue;
+            }
+            detail::append_pointer_token(path, key);
+            auto child = check(member ? member->rule : -1, cur.next(), cur, path, build);
+            path.resize(length);
+            if (build)
+                res->get_object()[key] = std::move(child);
+        }
+        for (size_t i = 0; i < seen.size(); ++i)
+            if (!seen[i])
+                throw SchemaError(path, "missing required member \"" + rule.required[i] + "\"");
+        return res;
+    }
+
+    // Unconstrained values.
+    static void skip(JsonToken token, JsonCursor &cur)
+    {
+        if (token != JsonToken::kBeginArray && token != JsonToken::kBeginObject)
+            return;
+        while (cur.skip_value()) {
+        }
+        cur.next();
+    }
+
+    static std::shared_ptr<JsonNode> plain(JsonToken token, JsonCursor &cur)
+    {
+        switch (token) {
+        case JsonToken::kNull:
+            return std::make_shared<JsonNode>();
+        case JsonToken::kBool:
+            return std::make_shared<JsonBool>(cur.get_bool());
+        case JsonToken::kNumber:
+            return std::make_shared<JsonDouble>(cur.get_number());
+        case JsonToken::kString:
+            return std::make_shared<JsonString>(cur.get_string_view());
+        case JsonToken::kBeginArray: {
+            auto res = std::make_shared<JsonArray>();
+            while (auto child = cur.read_node())
+                res->get_array().push_back(std::move(child));
+            cur.next();
+            return numbers_if_possible(std::move(res));
+        }
+        default: {
+            auto res = std::make_shared<JsonObject>();
+            while (auto child = cur.read_node())
+                res->get_object()[cur.get_string_view()] = std::move(child);
+            cur.next();
+            return std::move(res);
+        }
+        }
+    }
+
+    // Same representation as parse_json: all-number arrays are stored unboxed.
+    static std::shared_ptr<JsonNode> numbers_if_possible(std::shared_ptr<JsonArray> array)
+    {
+        auto &vec = static_cast<const JsonArray &>(*array).get_array();
+        if (vec.empty())
+            return std::move(array);
+        std::vector<double> values;
+        values.reserve(vec.size());
+        for (auto &child : vec) {
+            if (child->get_type() != JsonType::kNumber)
+                return std::move(array);
+            values.push_back(static_cast<const JsonNode &>(*child).get_double());
+        }
+        return std::make_shared<JsonNumberArray>(std::move(values));
+    }
+};
+
+NAMESPACE_BEGIN(detail)
+
+// Deep copy, for values that are taken from a patch or duplicated.
+inline std::shared_ptr<JsonNode> clone_node(const JsonNode &node)
+{
+    switch (node.get_type()) {
+    case JsonType::kBool:
+        return std::make_shared<JsonBool>(node.get_bool());
+    case JsonType::kNumber:
+        return std::make_shared<JsonDouble>(node.get_double());
+    case JsonType::kString:
+        return std::make_shared<JsonString>(node.get_string());
+    case JsonType::kArray: {
+        if (auto *values = unboxed_values(node))
+            return std::make_shared<JsonNumberArray>(*values);
+        auto res = std::make_shared<JsonArray>();
+        auto &vec = res->get_array();
+        vec.reserve(node.get_array().size());
+        for (auto &child : node.get_array())
+            vec.push_back(clone_node(*child));
+        return std::move(res);
+    }
+    case JsonType::kObject: {
+        auto res = std::make_shared<JsonObject>();
+        auto &obj = res->get_object();
+        for (auto &kv : node.get_object())
+            obj[kv.first] = clone_node(*kv.second);
+        return std::move(res);
+    }
+    default:
+        return std::make_shared<JsonNode>();
+    }
+}
+
+// Applies RFC 6902 operations to a tree in place. Values are moved between
+// places, never copied, except for "copy" and values taken from the patch.
+// Every change is recorded so a failed patch can be rolled back; the log
+// holds the replaced/removed subtrees, not copies of the document.
+class PatchApplier
+{
+public:
+    explicit PatchApplier(std::shared_ptr<JsonNode> &root)
+        : root_(root)
+    {}
+
+    void apply(const JsonNode &op)
+    {
+        auto &members = op.get_object();
+        auto field = [&members](const char *name) -> const JsonNode & {
+            auto it = members.find(name);
+            if (it == members.end())
+                throw std::runtime_error(std::string("Missing \"") + name + "\"");
+            return *it->second;
+        };
+        const std::string &name = field("op").get_string();
+        const std::string &path = field("path").get_string();
+        if (name == "add") {
+            add(path, clone_node(field("value")));
+        } else if (name == "remove") {
+            remove(path);
+        } else if (name == "replace") {
+            remove(path);
+            add(path, clone_node(field("value")));
+        } else if (name == "move") {
+            const std::string &from = field("from").get_string();
+            if (path.compare(0, from.size(), from) == 0 && path.size() > from.size()
+                && path[from.size()] == '/')
+                throw std::runtime_error("Can not move " + from + " into itself");
+            add(path, remove(from));
+        } else if (name == "copy") {
+            add(path, clone_node(*get(field("from").get_string())));
+        } else if (name == "test") {
+            if (!structural_equal(*get(path), field("value")))
+                throw std::runtime_error("Test failed at " + path);
+        } else {
+            throw std::runtime_error("Unknown patch operation " + name);
+        }
+    }
+
+    // Keeps the changes so far; a later rollback() stops here.
+    void commit() { log_.clear(); }
+
+    // Reverts everything applied since the last commit().
+    void rollback()
+    {
+        for (auto it = log_.rbegin(); it != log_.rend(); ++it) {
+            Change &c = *it;
+            if (!c.container) {
+                root_ = std::move(c.old);
+            } else if (c.container->get_type() == JsonType::kObject) {
+                auto &obj = c.container->get_object();
+                if (c.old)
+                    obj[c.key] = std::move(c.old);
+                else
+                    obj.erase(c.key);
+            } else {
+                auto &vec = c.container->get_array();
+                auto pos = vec.begin() + static_cast<std::ptrdiff_t>(c.index);
+                if (c.old)
+                    vec.insert(pos, std::move(c.old));
+                else
+                    vec.erase(pos);
             }
-        } while (letter != '}');
+        }
+        log_.clear();
+    }
+
+private:
+    // One change; `old` is what was there before, nullptr if nothing was.
+    struct Change
+    {
+        std::shared_ptr<JsonNode> container; // nullptr: the root
+        std::string key;
+        size_t index;
+        std::shared_ptr<JsonNode> old;
+    };
+
+    std::shared_ptr<JsonNode> &root_;
+    std::vector<Change> log_;
+
+    // Array index token; "-" (one past the end) only where `allow_end` is set.
+    static size_t array_index(const std::string &token, size_t size, bool allow_end)
+    {
+        if (allow_end && token == "-")
+            return size;
+        bool digits = !token.empty() && (token == "0" || token[0] != '0');
+        for (char c : token)
+            digits = digits && c >= '0' && c <= '9';
+        size_t index = digits ? std::strtoul(token.c_str(), nullptr, 10) : SIZE_MAX;
+        if (index > size || (index == size && !allow_end))
+            throw std::runtime_error("Bad array index " + token);
+        return index;
+    }
+
+    static std::shared_ptr<JsonNode> child(const std::shared_ptr<JsonNode> &node,
+                                           const std::string &token)
+    {
+        const JsonNode &n = *node;
+        if (n.get_type() == JsonType::kObject) {
+            auto it = n.get_object().find(token);
+            if (it == n.get_object().end())
+                throw std::runtime_error("No member " + token);
+            return it->second;
+        }
+        if (n.get_type() == JsonType::kArray)
+            return n.get_array()[array_index(token, n.get_array().size(), false)];
+        throw std::runtime_error("Can not descend into a scalar at " + token);
+    }
+
+    std::shared_ptr<JsonNode> get(const std::string &path)
+    {
+        std::shared_ptr<JsonNode> node = root_;
+        for (auto &token : split_pointer(path))
+            node = child(node, token);
+        return node;
+    }
+
+    // Container holding the target of `path`; `last` receives the final token.
+    std::shared_ptr<JsonNode> parent(const std::string &path, std::string &last)
+    {
+        auto tokens = split_pointer(path);
+        last = std::move(tokens.back());
+        tokens.pop_back();
+        std::shared_ptr<JsonNode> node = root_;
+        for (auto &token : tokens)
+            node = child(node, token);
+        return node;
+    }
+
+    void add(const std::string &path, std::shared_ptr<JsonNode> value)
+    {
+        if (path.empty()) {
+            log_.push_back(Change{nullptr, std::string(), 0, root_});
+            root_ = std::move(value);
+            return;
+        }
+        std::string last;
+        auto container = parent(path, last);
+        if (container->get_type() == JsonType::kObject) {
+            auto &slot = container->get_object()[last];
+            log_.push_back(Change{container, last, 0, slot});
+            slot = std::move(value);
+        } else if (container->get_type() == JsonType::kArray) {
+            size_t size = static_cast<const JsonNode &>(*container).get_array().size();
+            size_t index = array_index(last, size, true);
+            auto &vec = container->get_array();
+            vec.insert(vec.begin() + static_cast<std::ptrdiff_t>(index), std::move(value));
+            log_.push_back(Change{container, std::string(), index, nullptr});
+        } else {
+            throw std::runtime_error("Can not add to a scalar at " + path);
+        }
+    }
+
+    std::shared_ptr<JsonNode> remove(const std::string &path)
+    {
+        if (path.empty()) {
+            log_.push_back(Change{nullptr, std::string(), 0, root_});
+            auto old = std::move(root_);
+            root_ = std::make_shared<JsonNode>();
+            return old;
+        }
+        std::string last;
+        auto container = parent(path, last);
+        auto old = child(container, last);
+        if (container->get_type() == JsonType::kObject) {
+            container->get_object().erase(last);
+            log_.push_back(Change{container, last, 0, old});
+        } else {
+            size_t size = static_cast<const JsonNode &>(*container).get_array().size();
+            size_t index = array_index(last, size, false);
+            auto &vec = container->get_array();
+            vec.erase(vec.begin() + static_cast<std::ptrdiff_t>(index));
+            log_.push_back(Change{container, std::string(), index, old});
+        }
+        return old;
+    }
+};
+
+inline void merge_into(std::shared_ptr<JsonNode> &target, const JsonNode &patch)
+{
+    if (patch.get_type() != JsonType::kObject) {
+        target = clone_node(patch);
+        return;
+    }
+    if (!target || target->get_type() != JsonType::kObject)
+        target = std::make_shared<JsonObject>();
+    auto &obj = target->get_object();
+    for (auto &kv : patch.get_object()) {
+        if (kv.second->get_type() == JsonType::kNull) {
+            obj.erase(kv.first);
+            continue;
+        }
+        auto it = obj.find(kv.first);
+        if (it != obj.end()) {
+            merge_into(it->second, *kv.second);
+        } else {
+            std::shared_ptr<JsonNode> value;
+            merge_into(value, *kv.second);
+            obj.emplace(kv.first, std::move(value));
+        }
+    }
+}
+
+inline void add_operation(JsonArray &patch,
+                          const char *op,
+                          const std::string &path,
+                          std::shared_ptr<JsonNode> value)
+{
+    auto res = std::make_shared<JsonObject>();
+    auto &obj = res->get_object();
+    obj["op"] = std::make_shared<JsonString>(op);
+    obj["path"] = std::make_shared<JsonString>(path);
+    if (value)
+        obj["value"] = std::move(value);
+    patch.get_array().push_back(std::move(res));
+}
+
+inline void diff_into(JsonArray &patch, std::string &path, const JsonNode &from, const JsonNode &to)
+{
+    if (structural_equal(from, to))
+        return;
+    size_t length = path.size();
+    if (from.get_type() == JsonType::kObject && to.get_type() == JsonType::kObject) {
+        auto &a = from.get_object();
+        auto &b = to.get_object();
+        for (auto &kv : a) {
+            append_pointer_token(path, kv.first);
+            auto it = b.find(kv.first);
+            if (it == b.end())
+                add_operation(patch, "remove", path, nullptr);
+            else
+                diff_into(patch, path, *kv.second, *it->second);
+            path.resize(length);
+        }
+        for (auto &kv : b) {
+            if (a.count(kv.first))
+                continue;
+            append_pointer_token(path, kv.first);
+            add_operation(patch, "add", path, clone_node(*kv.second));
+            path.resize(length);
+        }
+        return;
+    }
+    if (from.get_type() == JsonType::kArray && to.get_type() == JsonType::kArray) {
+        auto &a = from.get_array();
+        auto &b = to.get_array();
+        // equal elements at both ends need no operations
+        size_t head = 0;
+        while (head < a.size() && head < b.size() && structural_equal(*a[head], *b[head]))
+            ++head;
+        size_t tail = 0;
+        while (tail < a.size() - head && tail < b.size() - head
+               && structural_equal(*a[a.size() - 1 - tail], *b[b.size() - 1 - tail]))
+            ++tail;
+        size_t changed_a = a.size() - head - tail;
+        size_t changed_b = b.size() - head - tail;
+        size_t common = std::min(changed_a, changed_b);
+        for (size_t i = head; i < head + common; ++i) {
+            append_pointer_token(path, std::to_string(i));
+            diff_into(patch, path, *a[i], *b[i]);
+            path.resize(length);
+        }
+        // removals go from the back so earlier indices stay valid
+        for (size_t i = head + changed_a; i-- > head + common;) {
+            append_pointer_token(path, std::to_string(i));
+            add_operation(patch, "remove", path, nullptr);
+            path.resize(length);
+        }
+        for (size_t i = head + common; i < head + changed_b; ++i) {
+            append_pointer_token(path, std::to_string(i));
+            add_operation(patch, "add", path, clone_node(*b[i]));
+            path.resize(length);
+        }
+        return;
+    }
+    add_operation(patch, "replace", path, clone_node(to));
+}
+
+NAMESPACE_END(detail)
+
+// Applies an RFC 6902 JSON Patch (an array of operations) to `root` in place;
+// `root` itself is replaced when an operation targets "". Values are moved,
+// not copied, by "move"/"remove"/"replace". With `atomic` set a failing
+// operation undoes the ones before it, using a log of the replaced subtrees
+// rather than a copy of the document, and the error is rethrown. Without it
+// the operations before the failing one stay applied. A failing operation is
+// never left half-applied.
+inline void apply_patch(std::shared_ptr<JsonNode> &root, const JsonNode &patch, bool atomic = true)
+{
+    detail::PatchApplier applier(root);
+    size_t index = 0;
+    try {
+        for (auto &op : patch.get_array()) {
+            applier.apply(*op);
+            if (!atomic)
+                applier.commit();
+            ++index;
+        }
+    } catch (const std::exception &e) {
+        // without `atomic` this only reverts the failing operation, e.g. the
+        // removal done by a "move" whose target is invalid
+        applier.rollback();
+        throw std::runtime_error("Patch operation " + std::to_string(index) + ": " + e.what());
+    }
+}
+
+// Applies an RFC 7386 JSON Merge Patch to `root` in place.
+inline void apply_merge_patch(std::shared_ptr<JsonNode> &root, const JsonNode &patch)
+{
+    detail::merge_into(root, patch);
+}
+
+// JSON Patch turning `from` into `to`. Object members are compared by key and
+// arrays element by element after trimming equal elements at both ends, so
+// unchanged subtrees produce no operations.
+inline std::shared_ptr<JsonNode> make_patch(const JsonNode &from, const JsonNode &to)
+{
+    auto patch = std::make_shared<JsonArray>();
+    std::string path;
+    detail::diff_into(*patch, path, from, to);
+    return std::move(patch);
+}
+
+NAMESPACE_BEGIN(detail)
+
+// Copy of `node` with the value at tokens[i..] replaced by `value`, or removed
+// when `value` is null. Only the containers on the path are copied, and only
+// shallowly: their other children are shared with `node`.
+inline std::shared_ptr<JsonNode> path_copy(const JsonNode &node,
+                                           const std::vector<std::string> &tokens,
+                                           size_t i,
+                                           const std::shared_ptr<JsonNode> &value)
+{
+    const std::string &token = tokens[i];
+    bool last = i + 1 == tokens.size();
+    if (node.get_type() == JsonType::kObject) {
+        auto res = std::make_shared<JsonObject>(static_cast<const JsonObject &>(node));
+        auto &obj = res->get_object();
+        auto it = obj.find(token);
+        if (it == obj.end() && !(last && value))
+            throw std::runtime_error("No member " + token);
+        if (!last)
+            it->second = path_copy(*it->second, tokens, i + 1, value);
+        else if (value)
+            obj[token] = value;
+        else
+            obj.erase(it);
         return std::move(res);
     }
+    if (node.get_type() != JsonType::kArray)
+        throw std::runtime_error("Can not descend into a scalar at " + token);
+
+    // numbers stay unboxed while the change is a number too, so only read
+    // the elements through get_array() when they are boxed anyway
+    auto *values = unboxed_values(node);
+    size_t size = values ? values->size() : node.get_array().size();
+    size_t index = size;
+    if (!(last && value && token == "-")) {
+        char *end = nullptr;
+        index = std::strtoul(token.c_str(), &end, 10);
+        if (token.empty() || *end != '\0' || index >= size)
+            throw std::runtime_error("Bad array index " + token);
+    }
+    if (values && last && (!value || value->get_type() == JsonType::kNumber)) {
+        std::vector<double> copy(*values);
+        if (!value)
+            copy.erase(copy.begin() + static_cast<std::ptrdiff_t>(index));
+        else if (index == copy.size())
+            copy.push_back(static_cast<const JsonNode &>(*value).get_double());
+        else
+            copy[index] = static_cast<const JsonNode &>(*value).get_double();
+        return std::make_shared<JsonNumberArray>(std::move(copy));
+    }
+    auto res = std::make_shared<JsonArray>();
+    auto &children = res->get_array();
+    children = node.get_array();
+    auto pos = children.begin() + static_cast<std::ptrdiff_t>(index);
+    if (!last)
+        *pos = path_copy(**pos, tokens, i + 1, value);
+    else if (!value)
+        children.erase(pos);
+    else if (index == children.size())
+        children.push_back(value);
+    else
+        *pos = value;
+    return std::move(res);
+}
+
+NAMESPACE_END(detail)
+
+// Read-only handle on a node of an immutable tree, e.g. a SharedDocument
+// version. A const JsonNode& is only shallowly const, its containers hand out
+// mutable children; a JsonView hands out views instead, so nothing reachable
+// from it can change the tree. Numeric arrays are only ever boxed through the
+// thread-safe const path, so any number of threads may read the same tree.
+// Accessors of an invalid view throw.
+class JsonView
+{
+public:
+    JsonView() = default;
+    explicit JsonView(std::shared_ptr<const JsonNode> node)
+        : node_(std::move(node))
+    {}
+
+    bool valid() const { return node_ != nullptr; }
+    explicit operator bool() const { return valid(); }
+
+    JsonType get_type() const { return node().get_type(); }
+    bool get_bool() const { return node().get_bool(); }
+    double get_double() const { return node().get_double(); }
+    const std::string &get_string() const { return node().get_string(); }
+    // Values of a numeric array that is stored unboxed; throws otherwise.
+    const std::vector<double> &get_numbers() const { return node().get_numbers(); }
+
+    // Number of elements of an array or members of an object.
+    size_t size() const
+    {
+        const JsonNode &n = node();
+        if (n.get_type() == JsonType::kObject)
+            return n.get_object().size();
+        if (n.get_type() != JsonType::kArray)
+            throw std::runtime_error("It's not an array or object");
+        auto *values = detail::unboxed_values(n);
+        return values ? values->size() : n.get_array().size();
+    }
+    JsonView at(size_t index) const { return JsonView(node().get_array().at(index)); }
+    // Returns an invalid view if `key` is not a member.
+    JsonView find(const std::string &key) const
+    {
+        auto &obj = node().get_object();
+        auto it = obj.find(key);
+        return it != obj.end() ? JsonView(it->second) : JsonView();
+    }
+    // Calls f(key, view) for every member of an object.
+    template<typename F>
+    void for_each_member(F f) const
+    {
+        for (auto &kv : node().get_object())
+            f(kv.first, JsonView(kv.second));
+    }
+
+    // Deep copy that may be changed freely.
+    std::shared_ptr<JsonNode> to_node() const { return detail::clone_node(node()); }
+    // Same layout as JsonNode::write.
+    void write(std::ostream &out, int idt = 0) const { detail::write_node(node(), out, idt); }
+
+    bool operator==(const JsonView &other) const
+    {
+        return structural_equal(node(), other.node());
+    }
+    bool operator!=(const JsonView &other) const { return !(*this == other); }
+    // The node itself; two views of a shared subtree return the same pointer.
+    const void *identity() const { return node_.get(); }
+
+private:
+    friend class SharedDocument;
+    friend JsonView set_persistent(const JsonView &, const std::string &,
+                                   std::shared_ptr<const JsonNode>);
+    friend JsonView erase_persistent(const JsonView &, const std::string &);
+
+    std::shared_ptr<const JsonNode> node_;
 
-    else {
-        throw std::runtime_error(std::string("Parser found unexpected character ") + letter);
+    const JsonNode &node() const
+    {
+        if (!node_)
+            throw std::runtime_error("It's an invalid JsonView");
+        return *node_;
     }
+};
+
+// Persistent updates: a new version of `root` with `value` at `path`, or with
+// the value at `path` removed. The versions share every subtree off the path,
+// so an update costs O(depth * fanout) instead of a copy of the document.
+// `path` may name a new object member, or "-" to append to an array. `value`
+// becomes part of the new version and must not be changed afterwards.
+inline JsonView set_persistent(const JsonView &root,
+                               const std::string &path,
+                               std::shared_ptr<const JsonNode> value)
+{
+    auto tokens = detail::split_pointer(path);
+    if (tokens.empty())
+        return JsonView(std::move(value));
+    auto node = std::const_pointer_cast<JsonNode>(std::move(value));
+    return JsonView(detail::path_copy(root.node(), tokens, 0, node));
 }
+inline JsonView erase_persistent(const JsonView &root, const std::string &path)
+{
+    auto tokens = detail::split_pointer(path);
+    if (tokens.empty())
+        throw std::runtime_error("Can not erase the root");
+    return JsonView(detail::path_copy(root.node(), tokens, 0, nullptr));
+}
+
+// Immutable document shared between threads. Readers take a snapshot(), a
+// read-only view of a version that never changes, and keep it as long as they
+// like; writers build a new version with path copying and publish it with an
+// atomic pointer swap, so readers never wait for an update to be built.
+// Concurrent writers retry on the newest version, so no update is lost.
+class SharedDocument
+{
+public:
+    // The document takes over `root`, which must not be changed afterwards.
+    explicit SharedDocument(std::shared_ptr<const JsonNode> root = std::make_shared<JsonNode>())
+        : root_(std::move(root))
+    {}
+    SharedDocument(const SharedDocument &) = delete;
+    SharedDocument &operator=(const SharedDocument &) = delete;
+
+    JsonView snapshot() const { return JsonView(load()); }
+
+    // Replaces the whole document; same contract as the constructor.
+    void publish(std::shared_ptr<const JsonNode> root)
+    {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        root_.store(std::move(root));
+#else
+        std::atomic_store(&root_, std::move(root));
+#endif
+    }
+
+    // Publishes update(current) for the current version and returns it.
+    // `update` gets a JsonView and builds the new version from it, e.g. with
+    // set_persistent(); it runs again if another writer got in between.
+    template<typename Update>
+    JsonView update(Update update)
+    {
+        std::shared_ptr<const JsonNode> current = load();
+        for (;;) {
+            std::shared_ptr<const JsonNode> next = update(JsonView(current)).node_;
+#if defined(__cpp_lib_atomic_shared_ptr)
+            if (root_.compare_exchange_weak(current, next))
+#else
+            if (std::atomic_compare_exchange_weak(&root_, &current, next))
+#endif
+                return JsonView(std::move(next));
+        }
+    }
+
+    JsonView set(const std::string &path, std::shared_ptr<const JsonNode> value)
+    {
+        return update(
+            [&](const JsonView &current) { return set_persistent(current, path, value); });
+    }
+    JsonView erase(const std::string &path)
+    {
+        return update([&](const JsonView &current) { return erase_persistent(current, path); });
+    }
+
+private:
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<std::shared_ptr<const JsonNode>> root_;
+#else
+    std::shared_ptr<const JsonNode> root_; // only accessed through std::atomic_*
+#endif
+
+    std::shared_ptr<const JsonNode> load() const
+    {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        return root_.load();
+#else
+        return std::atomic_load(&root_);
+#endif
+    }
+};
 
 NAMESPACE_END(pd)
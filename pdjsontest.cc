@@ -1,9 +1,31 @@
 #include "pdjson.hpp"
 #include "include/minunit.h"
+#include <atomic>
 #include <limits>
+#include <new>
 
 using namespace pd;
 
+// counts heap allocations so tests can check allocation-free paths; atomic as
+// several tests allocate from worker threads
+static std::atomic<size_t> heap_allocations(0);
+
+void *operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
 static void TEST_STRING(std::string expect, std::string json)
 {
     std::stringstream ins(json);
@@ -185,6 +207,831 @@ MU_TEST(test_new_json)
     jobj.write_to_file("test1.json");
 }
 
+MU_TEST(test_json_writer)
+{
+    {
+        std::string buf;
+        JsonWriter w(buf);
+        w.begin_object();
+        w.key("name").value("bob");
+        w.key("age").value(42);
+        w.key("ok").value(true);
+        w.key("tags").begin_array().value(1.5).null_value().value("a\"b").end_array();
+        w.key("empty").begin_object().end_object();
+        w.end_object();
+        mu_check(w.complete());
+        mu_assert_string_eq(
+            "{\"name\":\"bob\",\"age\":42,\"ok\":true,\"tags\":[1.5,null,\"a\\\"b\"],\"empty\":{}}",
+            buf.c_str());
+
+        std::stringstream ins(buf);
+        auto res = parse_json(ins);
+        mu_assert_string_eq("a\"b",
+                            res->get_object()["tags"]->get_array().at(2)->get_string().c_str());
+    }
+
+    {
+        // a tiny buffer forces a flush after nearly every value
+        std::ostringstream oss;
+        {
+            JsonWriter w(oss, 4);
+            w.begin_array();
+            for (int i = 0; i < 100; i++)
+                w.value(i);
+            w.end_array();
+        }
+        std::stringstream ins(oss.str());
+        mu_check(parse_json(ins)->get_type() == JsonType::kArray);
+        mu_check(oss.str().size() > 100);
+    }
+
+#if !defined(NDEBUG)
+    {
+        std::string buf;
+        JsonWriter w(buf);
+        w.begin_array();
+        bool thrown = false;
+        try {
+            w.key("oops");
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        mu_check(thrown);
+
+        thrown = false;
+        try {
+            w.end_object();
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        mu_check(thrown);
+    }
+#endif
+}
+
+MU_TEST(test_write_parallel)
+{
+    auto root = std::make_shared<JsonObject>();
+    auto rows = std::make_shared<JsonArray>();
+    for (int i = 0; i < 5000; i++) {
+        auto row = std::make_shared<JsonObject>();
+        row->insert<JsonDouble>("id", i);
+        row->insert<JsonString>("name", "row\t" + std::to_string(i));
+        auto tags = std::make_shared<JsonArray>();
+        for (int j = 0; j < i % 7; j++)
+            tags->get_array().push_back(std::make_shared<JsonBool>(j % 2 == 0));
+        row->get_object()["tags"] = tags;
+        rows->get_array().push_back(row);
+    }
+    (*root)["rows"] = rows;
+    (*root)["count"] = std::make_shared<JsonDouble>(5000);
+    (*root)["empty"] = std::make_shared<JsonArray>();
+
+    std::ostringstream sequential;
+    root->write(sequential, 0);
+
+    for (size_t grain : {size_t(1), size_t(7), size_t(100), size_t(1) << 20}) {
+        ParallelWriteOptions options;
+        options.threads = 4;
+        options.grain = grain;
+        std::ostringstream parallel;
+        write_parallel(*root, parallel, 0, options);
+        mu_check(sequential.str() == parallel.str());
+    }
+
+    JsonString leaf("leaf");
+    std::ostringstream oss;
+    write_parallel(leaf, oss);
+    mu_assert_string_eq("\"leaf\"", oss.str().c_str());
+}
+
+MU_TEST(test_parse_numbers_and_whitespace)
+{
+    std::stringstream ins(" [ 1,2 , -3.5e1,[] ,{ } , \"\\u00e9\\ud83d\\ude00\" ] ");
+    auto res = parse_json(ins);
+    auto &vec = res->get_array();
+    mu_assert_int_eq(6, (int) vec.size());
+    mu_assert_double_eq(1.0, vec[0]->get_double());
+    mu_assert_double_eq(2.0, vec[1]->get_double());
+    mu_assert_double_eq(-35.0, vec[2]->get_double());
+    mu_check(vec[3]->get_array().empty());
+    mu_check(vec[4]->get_object().empty());
+    mu_assert_string_eq("\xc3\xa9\xf0\x9f\x98\x80", vec[5]->get_string().c_str());
+
+    bool thrown = false;
+    try {
+        std::stringstream bad("[1 2]");
+        parse_json(bad);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(test_document_parse)
+{
+    std::stringstream ins("{\"name\":\"bob\",\"ok\":true,\"list\":[1,null,\"x\",[2]],\"obj\":{}}");
+    JsonDocument doc = parse_document(ins);
+    JsonValue root = doc.root();
+    mu_check(root.get_type() == JsonType::kObject);
+    mu_assert_int_eq(4, (int) root.size());
+    mu_check("bob" == root.find("name").get_string());
+    mu_check(root.find("ok").get_bool());
+    mu_check(!root.find("missing"));
+
+    JsonValue list = root.find("list");
+    mu_assert_int_eq(4, (int) list.size());
+    mu_assert_double_eq(1.0, list.at(0).get_double());
+    mu_check(list.at(1).get_type() == JsonType::kNull);
+    mu_check("x" == list.at(2).get_string());
+    mu_assert_double_eq(2.0, list.at(3).at(0).get_double());
+    mu_check("list" == root.key(2));
+
+    // an invalid handle throws instead of crashing
+    bool missing = false;
+    try {
+        root.find("user").find("id");
+    } catch (const std::runtime_error &) {
+        missing = true;
+    }
+    mu_check(missing);
+
+    // the shared tree writes the same bytes when member order does not matter
+    std::ostringstream from_doc, from_tree;
+    list.write(from_doc, 0);
+    list.to_node()->write(from_tree, 0);
+    mu_check(from_doc.str() == from_tree.str());
+
+    // re-parsing reuses the document
+    std::stringstream again("[true]");
+    doc.parse(again);
+    mu_check(doc.root().at(0).get_bool());
+    mu_assert_int_eq(2, (int) doc.node_count());
+
+    // a failed parse leaves a null document
+    std::stringstream bad("?");
+    bool thrown = false;
+    try {
+        doc.parse(bad);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(doc.root().get_type() == JsonType::kNull);
+}
+
+struct CountingResource : public MemoryResource
+{
+    size_t live = 0, calls = 0;
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        live += bytes;
+        calls++;
+        return new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        live -= bytes;
+        new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+};
+
+MU_TEST(test_document_memory_resource)
+{
+    CountingResource counting;
+    {
+        std::stringstream ins("{\"key\":\"a string longer than any small string buffer\","
+                              "\"list\":[1,2,3,{\"nested\":true}]}");
+        JsonDocument doc = parse_document(ins, &counting);
+        mu_check(doc.resource() == &counting);
+        mu_check(counting.calls > 0);
+        mu_check(counting.live > 0);
+        mu_check(doc.root().find("list").at(3).find("nested").get_bool());
+    }
+    mu_assert_int_eq(0, (int) counting.live);
+
+    {
+        char buffer[4096];
+        MonotonicResource arena(buffer, sizeof(buffer), &counting);
+        JsonDocument doc(&arena);
+        std::stringstream ins("[\"x\",\"y\",[true,false]]");
+        doc.parse(ins);
+        mu_check("y" == doc.root().at(1).get_string());
+        // everything fitted into the stack buffer
+        mu_assert_int_eq(0, (int) counting.live);
+    }
+}
+
+MU_TEST(test_projection_parse)
+{
+    std::stringstream ins("{\"user\":{\"id\":7,\"name\":\"bob\",\"tags\":[\"a\",{\"x\":\"]}\\\"\"}]},"
+                          "\"event\":{\"ts\":1.5e9,\"payload\":[[1,2],{\"deep\":[true]}]},"
+                          "\"items\":[{\"id\":1,\"v\":2},{\"id\":3,\"v\":4}],"
+                          "\"other\":\"ignored\"}");
+    auto res = parse_json(ins, JsonProjection{"/user/id", "/event/ts", "/items/*/id", "/a~1b"});
+    auto &obj = res->get_object();
+    mu_assert_int_eq(3, (int) obj.size());
+    mu_assert_int_eq(1, (int) obj["user"]->get_object().size());
+    mu_assert_double_eq(7.0, obj["user"]->get_object()["id"]->get_double());
+    mu_assert_double_eq(1.5e9, obj["event"]->get_object()["ts"]->get_double());
+    auto &items = obj["items"]->get_array();
+    mu_assert_int_eq(2, (int) items.size());
+    mu_assert_double_eq(3.0, items[1]->get_object()["id"]->get_double());
+    mu_check(items[1]->get_object().find("v") == items[1]->get_object().end());
+
+    // skipped array elements keep their position as null
+    std::stringstream arr("[{\"a\":1},{\"a\":2},{\"a\":3}]");
+    auto picked = parse_json(arr, JsonProjection{"/2/a"});
+    mu_assert_int_eq(3, (int) picked->get_array().size());
+    mu_check(picked->get_array()[0]->get_type() == JsonType::kNull);
+    mu_assert_double_eq(3.0, picked->get_array()[2]->get_object()["a"]->get_double());
+
+    // named tokens and "*" at the same level both apply, in either order
+    std::stringstream both("{\"user\":{\"id\":1,\"ts\":2,\"x\":3},\"sys\":{\"ts\":4,\"id\":5}}");
+    auto merged = parse_json(both, JsonProjection{"/user/id", "/*/ts"});
+    mu_assert_int_eq(2, (int) merged->get_object()["user"]->get_object().size());
+    mu_assert_int_eq(1, (int) merged->get_object()["sys"]->get_object().size());
+    std::stringstream rows("[{\"a\":1,\"b\":2},{\"a\":3,\"b\":4}]");
+    auto cols = parse_json(rows, JsonProjection{"/*/b", "/0/a"});
+    mu_assert_int_eq(2, (int) cols->get_array()[0]->get_object().size());
+    mu_assert_int_eq(1, (int) cols->get_array()[1]->get_object().size());
+    mu_assert_double_eq(4.0, cols->get_array()[1]->get_object()["b"]->get_double());
+
+    // the stream is left right after the document
+    std::stringstream two("{\"a\":[1,{\"b\":2}],\"c\":3} 42");
+    parse_json(two, JsonProjection{"/c"});
+    mu_assert_double_eq(42.0, parse_json(two)->get_double());
+}
+
+MU_TEST(test_number_array)
+{
+    std::stringstream ins("{\"samples\":[1, 2.5 ,-3e2,4],\"mixed\":[1,2,\"x\"],\"empty\":[]}");
+    auto res = parse_json(ins);
+    auto samples = res->get_object()["samples"];
+    mu_check(samples->get_type() == JsonType::kArray);
+    auto &numbers = samples->get_numbers();
+    mu_assert_int_eq(4, (int) numbers.size());
+    mu_assert_double_eq(-300.0, numbers[2]);
+    numbers[3] = 8;
+
+    auto mixed = res->get_object()["mixed"];
+    mu_assert_int_eq(3, (int) mixed->get_array().size());
+    mu_assert_double_eq(2.0, mixed->get_array()[1]->get_double());
+    mu_assert_string_eq("x", mixed->get_array()[2]->get_string().c_str());
+
+    // writes exactly like an array of JsonDouble
+    auto plain = std::make_shared<JsonArray>();
+    for (double v : {1.0, 2.5, -300.0, 8.0})
+        plain->get_array().push_back(std::make_shared<JsonDouble>(v));
+    std::ostringstream a, b;
+    samples->write(a, 2);
+    plain->write(b, 2);
+    mu_check(a.str() == b.str());
+
+    ParallelWriteOptions options;
+    options.threads = 3;
+    options.grain = 1;
+    std::ostringstream c;
+    write_parallel(*samples, c, 2, options);
+    mu_check(a.str() == c.str());
+
+    // precisions too long for the fast path still match JsonDouble
+    std::stringstream fine("[0.1,0.2]");
+    auto precise = parse_json(fine);
+    auto boxed = std::make_shared<JsonArray>();
+    boxed->get_array().push_back(std::make_shared<JsonDouble>(0.1));
+    boxed->get_array().push_back(std::make_shared<JsonDouble>(0.2));
+    std::ostringstream e, f;
+    e.precision(60);
+    f.precision(60);
+    precise->write(e, 0);
+    boxed->write(f, 0);
+    mu_check(e.str() == f.str());
+
+    // get_array() boxes the values on demand
+    mu_assert_double_eq(8.0, samples->get_array().at(3)->get_double());
+    samples->get_array().push_back(std::make_shared<JsonString>("tail"));
+    std::ostringstream d;
+    samples->write(d, 0);
+    mu_check(d.str().find("\"tail\"") != std::string::npos);
+
+    // parsed numeric arrays are still JsonArrays
+    std::stringstream nums("[5,6,7]");
+    auto arr = std::dynamic_pointer_cast<JsonArray>(parse_json(nums));
+    mu_check(arr != nullptr);
+    auto by_value = arr->create_index("");
+    mu_check(by_value->find(6) != nullptr);
+    arr->append(std::make_shared<JsonDouble>(9));
+    arr->erase(0);
+    mu_check(by_value->find(9) != nullptr && by_value->find(5) == nullptr);
+    mu_assert_double_eq(6.0, (*arr)[0]->get_double());
+    mu_assert_int_eq(3, (int) arr->get_array().size());
+
+    // concurrent first calls to get_array() box the values exactly once
+    std::stringstream shared_nums("[1,2,3,4]");
+    auto shared = parse_json(shared_nums);
+    size_t sizes[2] = {0, 0};
+    std::thread first([&]() { sizes[0] = shared->get_array().size(); });
+    std::thread second([&]() { sizes[1] = shared->get_array().size(); });
+    first.join();
+    second.join();
+    mu_assert_int_eq(4, (int) sizes[0]);
+    mu_assert_int_eq(4, (int) sizes[1]);
+}
+
+#if defined(PDJSON_HAS_ZLIB)
+static std::string gzip(const std::string &plain)
+{
+    z_stream zs = z_stream();
+    deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&zs, plain.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(plain.data()));
+    zs.avail_in = static_cast<uInt>(plain.size());
+    zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+#endif
+
+MU_TEST(test_compressed_input)
+{
+    std::string plain = "{\"rows\":[";
+    for (int i = 0; i < 20000; i++)
+        plain += (i ? ",\"row " : "\"row ") + std::to_string(i) + "\"";
+    plain += "]}";
+
+    DecompressOptions small_blocks;
+    small_blocks.block_size = 1000;
+    {
+        // plain input passes through
+        std::stringstream ins(plain);
+        auto res = parse_json_compressed(ins, small_blocks);
+        mu_assert_int_eq(20000, (int) res->get_object()["rows"]->get_array().size());
+    }
+    // top-level numbers whose first bytes pass the zlib header check
+    mu_assert_double_eq(80.0, parse_json_compressed("80", 2)->get_double());
+    mu_assert_double_eq(8017.0, parse_json_compressed("8017", 4)->get_double());
+
+#if defined(PDJSON_HAS_ZLIB)
+    std::string packed = gzip(plain);
+    mu_check(packed.size() < plain.size());
+    for (bool threaded : {false, true}) {
+        DecompressOptions options = small_blocks;
+        options.background_thread = threaded;
+        auto res = parse_json_compressed(packed.data(), packed.size(), options);
+        auto &rows = res->get_object()["rows"]->get_array();
+        mu_assert_int_eq(20000, (int) rows.size());
+        mu_assert_string_eq("row 19999", rows.back()->get_string().c_str());
+    }
+
+    {
+        // concatenated gzip members form one stream
+        std::stringstream ins(gzip("[1,2,") + gzip("3]"));
+        DecompressingStream z(ins);
+        JsonDocument doc = parse_document(z);
+        mu_assert_int_eq(3, (int) doc.root().size());
+    }
+
+    {
+        bool thrown = false;
+        try {
+            parse_json_compressed(packed.data(), packed.size() / 2);
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        mu_check(thrown);
+    }
+#endif
+}
+
+MU_TEST(test_cursor)
+{
+    std::stringstream ins("{\"a\" : [1, \"two\", {\"skip\": [1,[2,{}],\"]\"]}, true],"
+                          "\"b\":null, \"c\": {\"d\": 4}}");
+    JsonCursor cur(ins);
+    mu_check(cur.next() == JsonToken::kBeginObject);
+    mu_check(cur.next() == JsonToken::kKey);
+    mu_assert_string_eq("a", cur.get_string_view().c_str());
+    mu_check(cur.next() == JsonToken::kBeginArray);
+    mu_assert_int_eq(2, (int) cur.depth());
+    mu_check(cur.next() == JsonToken::kNumber);
+    mu_assert_double_eq(1.0, cur.get_number());
+    mu_check(cur.next() == JsonToken::kString);
+    mu_assert_string_eq("two", cur.get_string_view().c_str());
+    mu_check(cur.skip_value());
+    mu_check(cur.next() == JsonToken::kBool);
+    mu_check(cur.get_bool());
+    mu_check(!cur.skip_value());
+    mu_check(cur.next() == JsonToken::kEndArray);
+    mu_check(cur.skip_value()); // "b": null
+    mu_assert_string_eq("b", cur.get_string_view().c_str());
+    mu_check(cur.next() == JsonToken::kKey);
+    auto c = cur.read_node();
+    mu_assert_double_eq(4.0, c->get_object()["d"]->get_double());
+    mu_check(cur.next() == JsonToken::kEndObject);
+    mu_check(cur.next() == JsonToken::kEnd);
+    mu_check(cur.next() == JsonToken::kEnd);
+
+    // iterate a top-level array one element at a time
+    std::stringstream rows("[{\"id\":1},{\"id\":2},{\"id\":3}]");
+    JsonCursor it(rows);
+    mu_check(it.next() == JsonToken::kBeginArray);
+    double sum = 0;
+    while (auto row = it.read_node())
+        sum += row->get_object()["id"]->get_double();
+    mu_assert_double_eq(6.0, sum);
+    mu_check(it.next() == JsonToken::kEndArray);
+    mu_check(it.next() == JsonToken::kEnd);
+}
+
+MU_TEST(test_reusable_parser)
+{
+    std::vector<std::string> requests;
+    for (int i = 0; i < 50; i++)
+        requests.push_back("{\"id\":" + std::to_string(i) + ",\"user\":\"user-" + std::to_string(i)
+                           + "-with-a-long-name\",\"scores\":[1.5,2.25,-3e-2],\"ok\":true}");
+    requests.push_back("{\"broken\":");
+
+    Parser parser;
+    double ids = 0;
+    size_t errors = 0;
+    auto on_document = [&](size_t, const JsonDocument &doc) {
+        ids += doc.root().find("id").get_double();
+    };
+    auto on_error = [&](size_t index, const std::exception &) {
+        mu_assert_int_eq(50, (int) index);
+        errors++;
+    };
+    // warm up, then parse the same batch again without touching the heap
+    parser.parse_batch(requests.begin(), requests.end() - 1, on_document);
+    size_t before = heap_allocations;
+    parser.parse_batch(requests.begin(), requests.end() - 1, on_document);
+    mu_assert_int_eq(0, (int) (heap_allocations - before));
+    mu_assert_double_eq(2 * 1225.0, ids);
+
+    parser.parse_batch(requests.begin(), requests.end(), on_document, on_error);
+    mu_assert_int_eq(1, (int) errors);
+
+    const JsonDocument &doc = parser.parse(requests[7]);
+    mu_check("user-7-with-a-long-name" == doc.root().find("user").get_string());
+}
+
+MU_TEST(test_write_cache)
+{
+    std::stringstream in("{\"a\":{\"x\":1,\"y\":[true,\"s\"]},\"b\":[1,2,3],\"c\":\"t\"}");
+    auto root = parse_json(in);
+    auto render = [&]() {
+        std::ostringstream out;
+        root->write(out);
+        return out.str();
+    };
+    std::string plain = render();
+    root->set_write_cache(true);
+    mu_check(plain == render());
+    mu_check(plain == render());
+
+    // reads through const nodes keep the cache, non-const access invalidates it
+    const JsonNode &croot = *root;
+    mu_assert_double_eq(1, croot.get_object().at("a")->get_object().at("x")->get_double());
+    mu_check(plain == render());
+    root->get_object()["a"]->get_object()["x"]->get_double() = 5;
+    std::string changed = render();
+    mu_check(changed != plain);
+    mu_check(changed.find("\"x\" : 5") != std::string::npos);
+
+    root->get_object()["b"]->get_numbers().push_back(4);
+    mu_check(render().find("4\n") != std::string::npos);
+
+    // a different indentation is rendered afresh
+    std::ostringstream nested;
+    root->write(nested, 2);
+    mu_check(nested.str() != render());
+
+    // copies start without a cache and leave the original alone
+    JsonObject copy = static_cast<const JsonObject &>(*root);
+    copy.get_object()["c"] = std::make_shared<JsonString>("u");
+    mu_check(render().find("\"t\"") != std::string::npos);
+
+    root->set_write_cache(false);
+    std::string uncached = render();
+    root->set_write_cache(true);
+    mu_check(uncached == render());
+
+    // a subtree shared by two caching parents invalidates both
+    std::stringstream leaf("{\"k\":\"s\"}");
+    auto shared = parse_json(leaf);
+    auto a = std::make_shared<JsonArray>(), b = std::make_shared<JsonArray>();
+    a->append(shared);
+    b->append(shared);
+    a->set_write_cache(true);
+    b->set_write_cache(true);
+    auto text = [](JsonNode &node) {
+        std::ostringstream out;
+        node.write(out);
+        return out.str();
+    };
+    text(*a);
+    text(*b);
+    shared->get_object()["k"]->get_string() = "CHANGED";
+    mu_check(text(*b).find("CHANGED") != std::string::npos);
+    mu_check(text(*a).find("CHANGED") != std::string::npos);
+}
+
+MU_TEST(test_array_index)
+{
+    std::stringstream in("{\"orders\":[{\"id\":3,\"c\":\"x\"},{\"id\":1},{\"id\":2,\"c\":\"y\"},"
+                         "{\"c\":\"z\"},{\"id\":[1]}]}");
+    auto root = parse_json(in);
+    auto orders = std::dynamic_pointer_cast<JsonArray>(root->get_object()["orders"]);
+    mu_check(orders != nullptr);
+
+    auto by_id = orders->create_index("/id");
+    auto sorted = orders->create_index("/id", JsonIndexKind::kSorted);
+    auto by_c = orders->create_index("/c");
+    mu_assert_int_eq(3, (int) by_id->size());
+    mu_check("y" == by_id->find(2)->get_object().at("c")->get_string());
+    mu_check(by_id->find(7) == nullptr);
+    mu_check(by_id->find("3") == nullptr);
+    mu_check(by_c->find("z") == orders->get_array()[3]);
+
+    auto range = sorted->range(1, 2.5);
+    mu_assert_int_eq(2, (int) range.size());
+    mu_assert_double_eq(1, range[0]->get_object().at("id")->get_double());
+    mu_assert_double_eq(2, range[1]->get_object().at("id")->get_double());
+
+    // append/erase keep the indexes current
+    std::stringstream more("{\"id\":5,\"c\":\"x\"}");
+    orders->append(parse_json(more));
+    mu_check(by_id->find(5) != nullptr);
+    mu_assert_int_eq(2, (int) by_c->find_all("x").size());
+    orders->erase(0);
+    mu_check(by_id->find(3) == nullptr);
+    mu_check(sorted->find(3) == nullptr);
+    mu_assert_int_eq(1, (int) by_c->find_all("x").size());
+
+    // changes through get_array() are picked up on the next lookup
+    orders->get_array().clear();
+    mu_assert_int_eq(0, (int) by_id->size());
+    mu_check(by_c->find("z") == nullptr);
+
+    // and so are changes through get_numbers() of a numeric array
+    std::stringstream nums("[5,6,7]");
+    auto numbers = std::dynamic_pointer_cast<JsonArray>(parse_json(nums));
+    auto by_value = numbers->create_index("");
+    numbers->get_numbers()[0] = 100;
+    mu_check(by_value->find(100) != nullptr);
+    mu_check(by_value->find(5) == nullptr);
+
+    // the index outlives the array
+    std::stringstream last("{\"id\":5}");
+    orders->append(parse_json(last));
+    root.reset();
+    orders.reset();
+    mu_check(by_id->find(5) != nullptr);
+}
+
+MU_TEST(test_structural_hash_and_cache)
+{
+    std::string a = "{\"name\":\"cfg\",\"limits\":[1,2,3],\"nested\":{\"x\":true,\"y\":null}}";
+    std::string b = "{ \"nested\" : {\"y\":null, \"x\":true}, \"limits\":[1.0, 2, 3e0],"
+                    " \"name\":\"cfg\" }";
+    mu_check(content_hash(a) == content_hash(std::string(a)));
+    mu_check(content_hash(a) != content_hash(b));
+
+    std::stringstream ia(a), ib(b), ic("{\"name\":\"cfg\",\"limits\":[1,2],\"nested\":{}}");
+    auto na = parse_json(ia), nb = parse_json(ib), nc = parse_json(ic);
+    mu_check(structural_hash(*na) == structural_hash(*nb));
+    mu_check(structural_equal(*na, *nb));
+    mu_check(structural_hash(*na) != structural_hash(*nc));
+    mu_check(!structural_equal(*na, *nc));
+
+    // a boxed numeric array still equals an unboxed one
+    na->get_object()["limits"]->get_array();
+    mu_check(structural_hash(*na) == structural_hash(*nb));
+    mu_check(structural_equal(*nb, *na));
+
+    ParseCache cache(4096);
+    auto first = cache.parse(a);
+    auto second = cache.parse(a);
+    mu_check(first == second);
+    mu_assert_int_eq(1, (int) cache.hits());
+    mu_check(cache.parse(b) != first);
+    mu_assert_int_eq(2, (int) cache.size());
+    mu_check(cache.memory_usage() <= 4096);
+
+    // the budget evicts the least recently used entries
+    for (int i = 0; i < 100; i++)
+        cache.parse("{\"filler\":\"" + std::string(200, 'a' + i % 26) + std::to_string(i) + "\"}");
+    mu_check(cache.memory_usage() <= 4096);
+    mu_check(cache.parse(a) != first);
+
+    ParseCache tiny(16);
+    tiny.parse(a);
+    mu_assert_int_eq(0, (int) tiny.size());
+}
+
+MU_TEST(test_schema)
+{
+    std::stringstream schema_text(
+        "{\"type\":\"object\",\"required\":[\"id\",\"tags\"],\"properties\":{"
+        "\"id\":{\"type\":\"integer\",\"minimum\":1},"
+        "\"name\":{\"type\":\"string\",\"maxLength\":4},"
+        "\"kind\":{\"enum\":[\"a\",\"b\",[1,2]]},"
+        "\"tags\":{\"type\":\"array\",\"items\":{\"type\":[\"string\",\"null\"]}},"
+        "\"score\":{\"type\":\"number\",\"maximum\":10}}}");
+    JsonSchema schema(schema_text);
+
+    auto error_path = [&](const std::string &text) -> std::string {
+        std::stringstream in(text);
+        try {
+            schema.validate(in);
+        } catch (const SchemaError &e) {
+            return e.path();
+        }
+        return "valid";
+    };
+    mu_check("valid" == error_path("{\"id\":3,\"tags\":[\"x\",null],\"extra\":{\"deep\":[1,{}]}}"));
+    mu_check("valid"
+             == error_path("{\"id\":3,\"tags\":[],\"kind\":[1,2],\"name\":\"\\u00e9t\\u00e9\"}"));
+    mu_check("/id" == error_path("{\"id\":3.5,\"tags\":[]}"));
+    mu_check("/id" == error_path("{\"id\":0,\"tags\":[]}"));
+    mu_check("/score" == error_path("{\"id\":1,\"score\":11,\"tags\":[]}"));
+    mu_check("/name" == error_path("{\"id\":1,\"name\":\"toolong\",\"tags\":[]}"));
+    mu_check("/kind" == error_path("{\"id\":1,\"kind\":\"c\",\"tags\":[]}"));
+    mu_check("/kind" == error_path("{\"id\":1,\"kind\":[1,3],\"tags\":[]}"));
+    mu_check("/tags/1" == error_path("{\"id\":1,\"tags\":[\"x\",2]}"));
+    mu_check("" == error_path("{\"id\":1}"));
+    mu_check("" == error_path("[]"));
+
+    // elements without constraints are skipped as a whole
+    std::stringstream any_items("{\"type\":\"array\"}"), rows("[1,\"x\",{\"a\":[true]},[]] 5");
+    JsonSchema(any_items).validate(rows);
+    mu_assert_double_eq(5.0, parse_json(rows)->get_double());
+
+    // parsing and validating in one pass gives the same tree as parse_json
+    std::string text = "{\"id\":7,\"tags\":[\"a\"],\"extra\":[1,2],\"score\":1.5}";
+    std::stringstream in(text), plain(text);
+    auto node = schema.parse(in);
+    mu_check(structural_equal(*node, *parse_json(plain)));
+    mu_check(std::dynamic_pointer_cast<JsonNumberArray>(node->get_object()["extra"]) != nullptr);
+
+    std::stringstream bad("{\"id\":7,\"tags\":[1]}");
+    bool thrown = false;
+    try {
+        schema.parse(bad);
+    } catch (const SchemaError &e) {
+        thrown = e.path() == "/tags/0";
+    }
+    mu_check(thrown);
+}
+
+MU_TEST(test_json_patch)
+{
+    auto parse = [](const std::string &text) {
+        std::stringstream in(text);
+        return parse_json(in);
+    };
+    auto doc = parse("{\"a\":{\"b\":[1,2,3],\"c\":\"x\"},\"d\":{\"big\":[\"kept\"]}}");
+    auto moved = doc->get_object()["d"];
+    apply_patch(doc,
+                *parse("[{\"op\":\"add\",\"path\":\"/a/b/1\",\"value\":9},"
+                       "{\"op\":\"remove\",\"path\":\"/a/c\"},"
+                       "{\"op\":\"move\",\"from\":\"/d\",\"path\":\"/a/m~1n\"},"
+                       "{\"op\":\"copy\",\"from\":\"/a/b\",\"path\":\"/b2\"},"
+                       "{\"op\":\"replace\",\"path\":\"/b2/0\",\"value\":0},"
+                       "{\"op\":\"add\",\"path\":\"/b2/-\",\"value\":4},"
+                       "{\"op\":\"test\",\"path\":\"/a/b\",\"value\":[1,9,2,3]}]"));
+    std::string expected = "{\"a\":{\"b\":[1,9,2,3],\"m/n\":{\"big\":[\"kept\"]}},"
+                           "\"b2\":[0,9,2,3,4]}";
+    mu_check(structural_equal(*doc, *parse(expected)));
+    // moved, not copied
+    mu_check(doc->get_object()["a"]->get_object()["m/n"] == moved);
+
+    // a failing operation rolls the whole patch back
+    auto failing = parse("[{\"op\":\"remove\",\"path\":\"/b2/0\"},"
+                         "{\"op\":\"move\",\"from\":\"/a/m~1n\",\"path\":\"/x\"},"
+                         "{\"op\":\"replace\",\"path\":\"\",\"value\":1},"
+                         "{\"op\":\"test\",\"path\":\"/missing\",\"value\":1}]");
+    bool thrown = false;
+    try {
+        apply_patch(doc, *failing);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_check(thrown);
+    mu_check(structural_equal(*doc, *parse(expected)));
+    mu_check(doc->get_object()["a"]->get_object()["m/n"] == moved);
+    thrown = false;
+    try {
+        apply_patch(doc, *failing, false);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_check(thrown && doc->get_type() == JsonType::kNumber);
+
+    // a failing move is undone even when the patch is not atomic
+    auto half = parse("{\"a\":{\"x\":1},\"b\":2}");
+    thrown = false;
+    try {
+        apply_patch(half, *parse("[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/b/c/d\"}]"), false);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_check(thrown && structural_equal(*half, *parse("{\"a\":{\"x\":1},\"b\":2}")));
+
+    auto merged = parse("{\"title\":\"Goodbye!\",\"author\":{\"givenName\":\"John\","
+                        "\"familyName\":\"Doe\"},\"tags\":[\"example\",\"sample\"]}");
+    apply_merge_patch(merged,
+                      *parse("{\"title\":\"Hello!\",\"phoneNumber\":\"+01-123-456-7890\","
+                             "\"author\":{\"familyName\":null},\"tags\":[\"example\"]}"));
+    auto result = parse("{\"title\":\"Hello!\",\"author\":{\"givenName\":\"John\"},"
+                        "\"tags\":[\"example\"],\"phoneNumber\":\"+01-123-456-7890\"}");
+    mu_check(structural_equal(*merged, *result));
+
+    // diff produces only the changes and round-trips
+    auto from = parse("{\"same\":{\"deep\":[1,2,3]},\"list\":[1,2,3,4,5],\"gone\":true,\"v\":1}");
+    auto to = parse("{\"same\":{\"deep\":[1,2,3]},\"list\":[1,2,7,5],\"new\":null,\"v\":\"1\"}");
+    auto patch = make_patch(*from, *to);
+    mu_assert_int_eq(5, (int) patch->get_array().size());
+    apply_patch(from, *patch);
+    mu_check(structural_equal(*from, *to));
+    mu_assert_int_eq(0, (int) make_patch(*from, *to)->get_array().size());
+}
+
+MU_TEST(test_shared_document)
+{
+    std::stringstream in("{\"server\":{\"port\":80,\"hosts\":[\"a\",\"b\"]},"
+                         "\"limits\":[1,2,3],\"big\":{\"untouched\":[true]}}");
+    SharedDocument doc(parse_json(in));
+    JsonView v1 = doc.snapshot();
+
+    JsonView v2 = doc.set("/server/port", std::make_shared<JsonDouble>(8080));
+    doc.set("/server/hosts/-", std::make_shared<JsonString>("c"));
+    doc.set("/limits/0", std::make_shared<JsonDouble>(10));
+    doc.erase("/server/hosts/0");
+    JsonView v3 = doc.snapshot();
+
+    // old versions are unchanged and share what was not on the path
+    mu_assert_double_eq(80, v1.find("server").find("port").get_double());
+    mu_assert_double_eq(8080, v2.find("server").find("port").get_double());
+    mu_check(v1.find("big").identity() == v3.find("big").identity());
+    mu_check(v1.find("server").identity() != v2.find("server").identity());
+    JsonView hosts = v3.find("server").find("hosts");
+    mu_assert_int_eq(2, (int) hosts.size());
+    mu_check("c" == hosts.at(1).get_string());
+    mu_assert_double_eq(10, v3.find("limits").get_numbers()[0]);
+
+    // reading elements of a shared numeric array keeps it unboxed for everyone
+    mu_assert_double_eq(2, v1.find("limits").at(1).get_double());
+    mu_assert_int_eq(3, (int) v1.find("limits").get_numbers().size());
+    mu_check(v1.find("limits") == v1.find("limits"));
+    mu_check(v1 != v3);
+
+    std::stringstream written;
+    v1.write(written, 1);
+    mu_check(v1 == JsonView(parse_json(written)));
+    std::ostringstream from_view, from_tree;
+    v3.find("limits").write(from_view, 2);
+    v3.find("limits").to_node()->write(from_tree, 2);
+    mu_check(from_view.str() == from_tree.str());
+
+    // updating a large numeric array copies the values, not one node per element
+    auto wide = std::make_shared<JsonObject>();
+    wide->get_object()["a"] = std::make_shared<JsonNumberArray>(std::vector<double>(100000));
+    SharedDocument big(wide);
+    auto eight = std::make_shared<JsonDouble>(8);
+    size_t before = heap_allocations;
+    JsonView updated = big.set("/a/0", eight);
+    mu_check(heap_allocations - before < 32);
+    mu_assert_double_eq(8, updated.find("a").get_numbers()[0]);
+
+    // concurrent writers do not lose updates while readers take snapshots
+    doc.publish(std::make_shared<JsonObject>());
+    const int writers = 4, rounds = 200;
+    std::atomic<bool> done(false);
+    std::thread reader([&]() {
+        while (!done)
+            doc.snapshot().size();
+    });
+    std::vector<std::thread> threads;
+    for (int t = 0; t < writers; t++)
+        threads.emplace_back([&doc, t]() {
+            for (int i = 0; i < rounds; i++)
+                doc.set("/w" + std::to_string(t) + "-" + std::to_string(i),
+                        std::make_shared<JsonBool>(true));
+        });
+    for (auto &thread : threads)
+        thread.join();
+    done = true;
+    reader.join();
+    mu_assert_int_eq(writers * rounds, (int) doc.snapshot().size());
+}
+
 MU_TEST_SUITE(parser_suit)
 {
     MU_RUN_TEST(test_base_null_object);
@@ -195,6 +1042,22 @@ MU_TEST_SUITE(parser_suit)
     MU_RUN_TEST(test_array_parse);
     MU_RUN_TEST(test_object_parse);
     MU_RUN_TEST(test_new_json);
+    MU_RUN_TEST(test_json_writer);
+    MU_RUN_TEST(test_write_parallel);
+    MU_RUN_TEST(test_parse_numbers_and_whitespace);
+    MU_RUN_TEST(test_document_parse);
+    MU_RUN_TEST(test_document_memory_resource);
+    MU_RUN_TEST(test_projection_parse);
+    MU_RUN_TEST(test_number_array);
+    MU_RUN_TEST(test_compressed_input);
+    MU_RUN_TEST(test_cursor);
+    MU_RUN_TEST(test_reusable_parser);
+    MU_RUN_TEST(test_write_cache);
+    MU_RUN_TEST(test_array_index);
+    MU_RUN_TEST(test_structural_hash_and_cache);
+    MU_RUN_TEST(test_schema);
+    MU_RUN_TEST(test_json_patch);
+    MU_RUN_TEST(test_shared_document);
 }
 
 int main()